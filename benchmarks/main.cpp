@@ -1,17 +1,193 @@
 #include <benchmark/benchmark.h>
 #include <array>
+#include <chrono>
+#include <random>
+#include <string>
+#include <memory>
+#include <list>
+#include <map>
+#include <optional>
+#include <shared_mutex>
+#include <cmath>
+#include <numeric>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "MergeSort.h"
+#include "RadixSort.h"
+#include "SampleSort.h"
+#include "ExternalSort.h"
+#include "AdaptiveMergeSort.h"
+#include "PartialSort.h"
 #include "ForEach.h"
 #include "LockFreeQueue.h"
 #include "ThreadsafeQueue.h"
+#include "LockFreeStack.h"
+#include "ThreadsafeHashMap.h"
+#include "ThreadsafeCache.h"
 #include "ThreadPool.h"
+#include "ObjectPool.h"
+#include "LockFreeSkipList.h"
+#include "Pipeline.h"
+#include "Tracer.h"
+#include "TraceSpans.h"
 
 using Iterator = std::vector<int>::iterator;
 
+// Set by --perf_counters
+bool perfCountersEnabled = false;
+
+#ifdef __linux__
+constexpr std::uint64_t GetPerfCacheReadMisses(std::uint64_t cache)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+// Hardware and scheduler counters of a benchmark by perf_event_open, reported per iteration.
+// They count the constructing thread and the threads it starts afterwards, so it's created
+// first thing in a benchmark function, before any pool or worker thread. Counting only runs
+// between Start and Stop, which enclose the benchmark loop, so setup isn't counted. Every event
+// is opened on its own, events the kernel doesn't permit or the machine doesn't have are left out
+class PerfCounters
+{
+public:
+    explicit PerfCounters(benchmark::State& state) :
+        state(state)
+    {
+        descriptors.fill(-1);
+
+#ifdef __linux__
+        if (!perfCountersEnabled)
+        {
+            return;
+        }
+
+        for (std::size_t i = 0; i < events.size(); i++)
+        {
+            descriptors[i] = Open(events[i].type, events[i].config);
+        }
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (std::size_t i = 0; i < events.size(); i++)
+        {
+            if (descriptors[i] < 0)
+            {
+                continue;
+            }
+
+            // Value, time enabled and time running. Counts of threads started afterwards are
+            // added once they exit, and events sharing a counter are scaled up by the time they got
+            std::array<std::uint64_t, 3> values{};
+
+            if (read(descriptors[i], values.data(), sizeof(values)) == sizeof(values) && values[2] > 0)
+            {
+                double value = static_cast<double>(values[0]) * static_cast<double>(values[1]) / static_cast<double>(values[2]);
+                state.counters[events[i].name] = benchmark::Counter(value, benchmark::Counter::kAvgIterations);
+            }
+
+            close(descriptors[i]);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters(PerfCounters&&) = delete;
+
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    PerfCounters& operator=(PerfCounters&&) = delete;
+
+    // Both apply to the threads started since the constructor as well
+    void Start()
+    {
+#ifdef __linux__
+        Control(PERF_EVENT_IOC_RESET);
+        Control(PERF_EVENT_IOC_ENABLE);
+#endif
+    }
+
+    void Stop()
+    {
+#ifdef __linux__
+        Control(PERF_EVENT_IOC_DISABLE);
+#endif
+    }
+
+#ifdef __linux__
+    // Returns a disabled counter of the calling thread and its future threads, or -1 with errno set
+    static int Open(std::uint32_t type, std::uint64_t config)
+    {
+        perf_event_attr attributes{};
+        attributes.size = sizeof(attributes);
+        attributes.type = type;
+        attributes.config = config;
+        attributes.disabled = 1;
+        attributes.inherit = 1;
+        // Unprivileged users may only count their own user space code, software events like
+        // context switches happen in the kernel and count nothing then
+        attributes.exclude_kernel = type != PERF_TYPE_SOFTWARE;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+    }
+
+private:
+    void Control(unsigned long request)
+    {
+        for (int descriptor : descriptors)
+        {
+            if (descriptor >= 0)
+            {
+                ioctl(descriptor, request, 0);
+            }
+        }
+    }
+
+    struct Event
+    {
+        const char* name;
+        std::uint32_t type;
+        std::uint64_t config;
+    };
+
+    static constexpr std::array<Event, 6> events = { {
+        { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { "l1d_misses", PERF_TYPE_HW_CACHE, GetPerfCacheReadMisses(PERF_COUNT_HW_CACHE_L1D) },
+        { "llc_misses", PERF_TYPE_HW_CACHE, GetPerfCacheReadMisses(PERF_COUNT_HW_CACHE_LL) },
+        { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+    } };
+#else
+private:
+    static constexpr std::array<int, 6> events{};
+#endif
+
+    benchmark::State& state;
+    std::array<int, events.size()> descriptors;
+};
+
 template<void (*Algo)(Iterator, Iterator, std::less<>)>
 void BM_MergeSort(benchmark::State& state) 
 {
+    PerfCounters perfCounters(state);
+
     std::vector<int> vec;
     vec.reserve(state.range(0));
 
@@ -20,6 +196,8 @@ void BM_MergeSort(benchmark::State& state)
         vec.push_back(i);
     }
 
+    perfCounters.Start();
+
     for (auto _ : state)
     {
         std::vector<int> copy = vec;
@@ -28,6 +206,8 @@ void BM_MergeSort(benchmark::State& state)
 
         benchmark::ClobberMemory();
     }
+
+    perfCounters.Stop();
 }
 BENCHMARK(BM_MergeSort<&MergeSort<Iterator>>)->Name("MergeSort")->
     RangeMultiplier(2)->Range(1 << 16, 1 << 18);
@@ -36,9 +216,152 @@ BENCHMARK(BM_MergeSort<&ParallelMergeSortWithBuffer<Iterator>>)->Name("ParallelM
 BENCHMARK(BM_MergeSort<&ParallelMergeSortWithBufferCountThreads<Iterator>>)->Name("ParallelMergeSortLimitThreads")->
     RangeMultiplier(2)->Range(1 << 16, 1 << 18);
 
+template<void (*Algo)(Iterator, Iterator, ThreadPool&, std::less<>)>
+void BM_MergeSortOnPool(benchmark::State& state) 
+{
+    PerfCounters perfCounters(state);
+
+    std::vector<int> vec;
+    vec.reserve(state.range(0));
+
+    for (int i = state.range(0); i >= 0; i--)
+    {
+        vec.push_back(i);
+    }
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<int> copy = vec;
+
+        Algo(copy.begin(), copy.end(), pool, std::less<>());
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+}
+
+// Radix sort orders by the key itself, the comparator only fits it into the family
+void ParallelRadixSortByValue(Iterator begin, Iterator end, ThreadPool& pool, std::less<>)
+{
+    ParallelRadixSort(begin, end, pool);
+}
+
+BENCHMARK(BM_MergeSortOnPool<&ParallelMergeSortThreadPool<Iterator, ThreadPool>>)->Name("ParallelMergeSortThreadPool")->
+    RangeMultiplier(10)->Range(1'000'000, 100'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_MergeSortOnPool<&ParallelRadixSortByValue>)->Name("ParallelRadixSort")->
+    RangeMultiplier(10)->Range(1'000'000, 100'000'000)->Unit(benchmark::kMillisecond);
+
+// Orders like int, but has no sorting network, so the sort uses insertion sort below the cutoff
+struct InsertionSortedInt
+{
+    explicit InsertionSortedInt(int value = 0) :
+        value(value)
+    { }
+
+    int value;
+
+    bool operator<(const InsertionSortedInt& other) const
+    {
+        return value < other.value;
+    }
+};
+
+// Splits down to single elements, like the sort did before it had a base case
+struct UnsplitInt
+{
+    explicit UnsplitInt(int value = 0) :
+        value(value)
+    { }
+
+    int value;
+
+    bool operator<(const UnsplitInt& other) const
+    {
+        return value < other.value;
+    }
+};
+
+template<>
+struct MergeSortCutoff<UnsplitInt> : std::integral_constant<std::size_t, 1> {};
+
+template<typename T>
+void BM_MergeSortBaseCase(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    std::vector<T> vec(state.range(0));
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> distribution;
+
+    for (auto& value : vec)
+    {
+        value = T(distribution(generator));
+    }
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<T> copy = vec;
+
+        MergeSort(copy.begin(), copy.end(), std::less<>());
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MergeSortBaseCase<int>)->Name("MergeSortBaseCaseNetworkInt")->Range(1 << 10, 1 << 18);
+BENCHMARK(BM_MergeSortBaseCase<float>)->Name("MergeSortBaseCaseNetworkFloat")->Range(1 << 10, 1 << 18);
+BENCHMARK(BM_MergeSortBaseCase<InsertionSortedInt>)->Name("MergeSortBaseCaseInsertion")->Range(1 << 10, 1 << 18);
+BENCHMARK(BM_MergeSortBaseCase<UnsplitInt>)->Name("MergeSortBaseCaseNone")->Range(1 << 10, 1 << 18);
+
+// Scaling of the thread pool sort with its parallel merge step, second argument is the pool size
+void BM_MergeSortPoolScaling(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    std::vector<int> vec(state.range(0));
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> distribution;
+
+    for (auto& value : vec)
+    {
+        value = distribution(generator);
+    }
+
+    ThreadPool pool(state.range(1));
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<int> copy = vec;
+
+        ParallelMergeSortThreadPool(copy.begin(), copy.end(), pool);
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MergeSortPoolScaling)->Name("ParallelMergeSortPoolScaling")->
+    ArgsProduct({ { 1 << 20, 1 << 22 }, { 1, 2, 4, 8, 16, 32, 64 } })->UseRealTime();
+
 template<bool IsParallel>
 void BM_ForEach(benchmark::State& state)
 {
+    PerfCounters perfCounters(state);
+
     std::vector<int> vec;
     vec.reserve(state.range(0));
 
@@ -52,6 +375,8 @@ void BM_ForEach(benchmark::State& state)
         num += 1;
     };
 
+    perfCounters.Start();
+
     for (auto _ : state)
     {
         std::vector<int> copy = vec;
@@ -65,6 +390,8 @@ void BM_ForEach(benchmark::State& state)
             std::for_each(copy.begin(), copy.end(), lambda);
         }
     }
+
+    perfCounters.Stop();
 }
 BENCHMARK(BM_ForEach<true>)->Name("for_each")->RangeMultiplier(2)->Range(1 << 16, 1 << 18);
 BENCHMARK(BM_ForEach<false>)->Name("ParallelForEach")->RangeMultiplier(2)->Range(1 << 16, 1 << 18);
@@ -97,6 +424,10 @@ void PopFromQueue(Queue& queue, std::size_t amount)
 template<typename Queue>
 void BM_Queue(benchmark::State& state)
 {
+    PerfCounters perfCounters(state);
+
+    perfCounters.Start();
+
     for (auto _ : state)
     {
         Queue queue;
@@ -123,82 +454,1883 @@ void BM_Queue(benchmark::State& state)
             thread.join();
         }
         
-        assert(!queue.Pop());
+        if (queue.Pop())
+        {
+            state.SkipWithError("Queue holds more elements than were pushed");
+            break;
+        }
 
         benchmark::ClobberMemory();
     }
+
+    perfCounters.Stop();
 }
 BENCHMARK(BM_Queue<LockFree::Queue<int>>)->Name("LockfreeQueue")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
 BENCHMARK(BM_Queue<Threadsafe::Queue<int>>)->Name("ThreadsafeQueue")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
+BENCHMARK(BM_Queue<Stack<int>>)->Name("LockfreeStack")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
+BENCHMARK(BM_Queue<LockFree::Queue<int, PoolAllocator<int>>>)->Name("LockfreeQueuePool")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
+BENCHMARK(BM_Queue<Threadsafe::Queue<int, PoolAllocator<int>>>)->Name("ThreadsafeQueuePool")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
+BENCHMARK(BM_Queue<Stack<int, PoolAllocator<int>>>)->Name("LockfreeStackPool")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
 
-struct PoolStrategy
+// HDR style histogram: a value is bucketed by its highest set bit and the latencyHistogramBits bits
+// below it, so buckets have a fixed relative width of at most 1 / 2^latencyHistogramBits over the
+// whole 64 bit range, and values below 2^(latencyHistogramBits + 1) are exact
+inline constexpr std::size_t latencyHistogramBits = 5;
+
+class LatencyHistogram
 {
-    PoolStrategy() :
-        pool(std::thread::hardware_concurrency())
-    { }
+public:
+    void Record(std::uint64_t value)
+    {
+        std::size_t shift = 0;
 
-    ThreadPool pool;
+        while ((value >> shift) >= 2 * subBuckets)
+        {
+            shift++;
+        }
 
-    void Run(std::vector<int>& data)
-    {
-        std::vector<std::future<void>> futures;
-        futures.reserve(data.size());
+        counts[shift * subBuckets + (value >> shift)]++;
+        total++;
+        maximum = std::max(maximum, value);
+    }
 
-        for (std::size_t i = 0; i < data.size(); i++)
+    void Merge(const LatencyHistogram& other)
+    {
+        for (std::size_t i = 0; i < counts.size(); i++)
         {
-            futures.push_back(pool.Enqueue([&data, i]() { data[i]++; }));
+            counts[i] += other.counts[i];
         }
 
-        for (std::size_t i = 0; i < futures.size(); i++)
+        total += other.total;
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    // Highest value of the bucket the fraction of values reaches
+    std::uint64_t GetPercentile(double fraction) const
+    {
+        std::uint64_t rank = static_cast<std::uint64_t>(fraction * static_cast<double>(total));
+        std::uint64_t seen = 0;
+
+        for (std::size_t i = 0; i < counts.size(); i++)
         {
-            futures[i].wait();
+            seen += counts[i];
+
+            if (seen > rank)
+            {
+                std::size_t shift = i < 2 * subBuckets ? 0 : i / subBuckets - 1;
+                std::uint64_t bucketBegin = static_cast<std::uint64_t>(i - shift * subBuckets) << shift;
+
+                return std::min(bucketBegin + (std::uint64_t(1) << shift) - 1, maximum);
+            }
         }
+
+        return maximum;
+    }
+
+    std::uint64_t GetCount() const
+    {
+        return total;
+    }
+
+    std::uint64_t GetMaximum() const
+    {
+        return maximum;
     }
+
+private:
+    static constexpr std::size_t subBuckets = std::size_t(1) << latencyHistogramBits;
+
+    // Bucket shift * subBuckets + (value >> shift) for the smallest shift that leaves
+    // latencyHistogramBits + 1 bits of the value
+    std::array<std::uint64_t, (64 - latencyHistogramBits + 1) * subBuckets> counts{};
+    std::uint64_t total = 0;
+    std::uint64_t maximum = 0;
 };
 
-struct ThreadStrategy
+void ReportLatency(benchmark::State& state, const LatencyHistogram& histogram)
 {
-    void Run(std::vector<int>& data)
+    if (histogram.GetCount() == 0)
+    {
+        return;
+    }
+
+    state.counters["p50_ns"] = static_cast<double>(histogram.GetPercentile(0.5));
+    state.counters["p99_ns"] = static_cast<double>(histogram.GetPercentile(0.99));
+    state.counters["p999_ns"] = static_cast<double>(histogram.GetPercentile(0.999));
+    state.counters["max_ns"] = static_cast<double>(histogram.GetMaximum());
+}
+
+template<std::size_t Bytes>
+struct QueueMessage
+{
+    static_assert(Bytes >= sizeof(std::chrono::steady_clock::time_point), "The message has to hold its send time");
+
+    std::chrono::steady_clock::time_point sent;
+    std::array<char, Bytes - sizeof(std::chrono::steady_clock::time_point)> payload;
+};
+
+inline constexpr std::size_t queueLatencyMessages = std::size_t(1) << 14;
+inline constexpr std::chrono::microseconds queueBurstPause(50);
+
+// Producers push their share of the messages, if state.range(2) isn't 0 in bursts of that many
+// messages with a pause after each. Consumers pop until all messages arrived and record how long
+// every message spent in the queue
+template<template<typename...> class Queue, std::size_t Bytes>
+void BM_QueueLatency(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    using Message = QueueMessage<Bytes>;
+
+    std::size_t producers = state.range(0);
+    std::size_t consumers = state.range(1);
+    std::size_t burst = state.range(2);
+    LatencyHistogram latency;
+
+    perfCounters.Start();
+
+    for (auto _ : state)
     {
+        Queue<Message> queue;
+        std::atomic<std::size_t> consumed{ 0 };
+        std::vector<LatencyHistogram> histograms(consumers);
         std::vector<std::thread> threads;
-        threads.reserve(data.size());
 
-        for (std::size_t i = 0; i < data.size(); i++)
+        for (std::size_t producer = 0; producer < producers; producer++)
         {
-            threads.emplace_back([&data, i]() { data[i]++; });
+            std::size_t amount = queueLatencyMessages * (producer + 1) / producers - queueLatencyMessages * producer / producers;
+
+            threads.emplace_back([&queue, amount, burst]()
+            {
+                Message message{};
+
+                for (std::size_t i = 0; i < amount; i++)
+                {
+                    if (burst != 0 && i != 0 && i % burst == 0)
+                    {
+                        std::this_thread::sleep_for(queueBurstPause);
+                    }
+
+                    message.sent = std::chrono::steady_clock::now();
+                    queue.Push(message);
+                }
+            });
         }
 
-        for (std::size_t i = 0; i < threads.size(); i++)
+        for (std::size_t consumer = 0; consumer < consumers; consumer++)
         {
-            threads[i].join();
+            threads.emplace_back([&queue, &consumed, &histogram = histograms[consumer]]()
+            {
+                while (consumed.load(std::memory_order_relaxed) < queueLatencyMessages)
+                {
+                    auto message = queue.Pop();
+
+                    if (!message)
+                    {
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    auto now = std::chrono::steady_clock::now();
+                    histogram.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - message->sent).count());
+                    consumed.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        if (consumed.load() != queueLatencyMessages || queue.Pop())
+        {
+            state.SkipWithError("Queue lost or duplicated messages");
+            break;
+        }
+
+        for (const auto& histogram : histograms)
+        {
+            latency.Merge(histogram);
         }
     }
-};
 
-template<typename Strategy>
-void BM_ThreadPool(benchmark::State& state)
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * queueLatencyMessages);
+    ReportLatency(state, latency);
+}
+
+// Producers to consumers of 1:1, 1:N, N:1 and N:N, sending continuously or in bursts
+template<typename Benchmark>
+void AddQueueLatencyArguments(Benchmark* benchmark)
 {
-    std::vector<int> vec;
-    vec.reserve(state.range(0));
-    Strategy strategy;
+    constexpr std::int64_t many = 4;
 
-    for (int i = state.range(0); i >= 0; i--)
+    benchmark->ArgNames({ "producers", "consumers", "burst" });
+
+    for (std::int64_t burst : { 0, 64 })
     {
-        vec.push_back(i);
+        benchmark->Args({ 1, 1, burst });
+        benchmark->Args({ 1, many, burst });
+        benchmark->Args({ many, 1, burst });
+        benchmark->Args({ many, many, burst });
     }
 
-    ThreadPool pool(std::thread::hardware_concurrency());
+    benchmark->UseRealTime();
+}
+BENCHMARK(BM_QueueLatency<LockFree::Queue, 16>)->Name("QueueLatencyLockfree16B")->Apply(AddQueueLatencyArguments);
+BENCHMARK(BM_QueueLatency<LockFree::Queue, 64>)->Name("QueueLatencyLockfree64B")->Apply(AddQueueLatencyArguments);
+BENCHMARK(BM_QueueLatency<LockFree::Queue, 256>)->Name("QueueLatencyLockfree256B")->Apply(AddQueueLatencyArguments);
+BENCHMARK(BM_QueueLatency<Threadsafe::Queue, 16>)->Name("QueueLatencyThreadsafe16B")->Apply(AddQueueLatencyArguments);
+BENCHMARK(BM_QueueLatency<Threadsafe::Queue, 64>)->Name("QueueLatencyThreadsafe64B")->Apply(AddQueueLatencyArguments);
+BENCHMARK(BM_QueueLatency<Threadsafe::Queue, 256>)->Name("QueueLatencyThreadsafe256B")->Apply(AddQueueLatencyArguments);
+
+template<typename Map>
+void FillAndEraseMap(Map& map, int firstKey, int amount)
+{
+    for (int key = firstKey; key < firstKey + amount; key++)
+    {
+        map.AddOrUpdate(key, key);
+    }
+
+    for (int key = firstKey; key < firstKey + amount; key++)
+    {
+        map.Erase(key);
+    }
+}
+
+template<typename Map>
+void BM_HashMapNodes(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    perfCounters.Start();
 
     for (auto _ : state)
     {
-        std::vector<int> copy = vec;
-        
-        strategy.Run(copy);
+        Map map;
+
+        std::array<std::thread, 4> threads;
+        int amountPerThread = static_cast<int>(state.range(0) / threads.size());
+        for (std::size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i] = std::thread(FillAndEraseMap<Map>, std::ref(map), static_cast<int>(i) * amountPerThread, amountPerThread);
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
 
         benchmark::ClobberMemory();
     }
+
+    perfCounters.Stop();
 }
-BENCHMARK(BM_ThreadPool<ThreadStrategy>)->Name("CreateThreads")->RangeMultiplier(2)->Range(1 << 8, 1 << 10);
-BENCHMARK(BM_ThreadPool<PoolStrategy>)->Name("CreateThreadPool")->RangeMultiplier(2)->Range(1 << 8, 1 << 10);
+BENCHMARK(BM_HashMapNodes<HashMap<int, int>>)->Name("HashMapNodes")->RangeMultiplier(2)->Range(1 << 10, 1 << 12);
+BENCHMARK(BM_HashMapNodes<HashMap<int, int, 17u, std::hash<int>, PoolAllocator<std::pair<int, int>>>>)->Name("HashMapNodesPool")->
+    RangeMultiplier(2)->Range(1 << 10, 1 << 12);
+
+template<typename Map>
+void BM_HashMapGet(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr std::size_t amountOfLookups = 4096u;
+    int amount = static_cast<int>(state.range(0));
+
+    Map map;
+    for (int key = 0; key < amount; key++)
+    {
+        map.AddOrUpdate(key, key);
+    }
+
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> distribution(0, amount - 1);
+    std::vector<int> keys(amountOfLookups);
+    std::generate(keys.begin(), keys.end(), [&]() { return distribution(generator); });
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        for (int key : keys)
+        {
+            benchmark::DoNotOptimize(map.Get(key));
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * amountOfLookups);
+}
+BENCHMARK(BM_HashMapGet<HashMap<int, int>>)->Name("HashMapGetChained")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapGet<FlatHashMap<int, int>>)->Name("HashMapGetFlat")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+// Same as int, but forced to take the shared lock in Get to compare against optimistic reads
+enum class LockedReadKey : int {};
+
+template<>
+struct AllowOptimisticReads<LockedReadKey, int> : std::false_type {};
+
+// A request fanning out to 1000 keys, looked up one by one or as a single batch
+template<typename Map, typename Key, bool Batched>
+void BM_HashMapFanout(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr std::size_t batchSize = 1000u;
+    int amount = static_cast<int>(state.range(0));
+
+    Map map;
+    for (int key = 0; key < amount; key++)
+    {
+        map.AddOrUpdate(static_cast<Key>(key), key);
+    }
+
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> distribution(0, amount - 1);
+    std::vector<Key> keys(batchSize);
+    std::generate(keys.begin(), keys.end(), [&]() { return static_cast<Key>(distribution(generator)); });
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        if constexpr (Batched)
+        {
+            benchmark::DoNotOptimize(map.MultiGet(keys));
+        }
+        else
+        {
+            for (const Key& key : keys)
+            {
+                benchmark::DoNotOptimize(map.Get(key));
+            }
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * batchSize);
+}
+BENCHMARK(BM_HashMapFanout<HashMap<int, int>, int, false>)->Name("HashMapFanoutGetChained")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanout<HashMap<int, int>, int, true>)->Name("HashMapFanoutMultiGetChained")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanout<FlatHashMap<int, int>, int, false>)->Name("HashMapFanoutGetFlat")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanout<FlatHashMap<int, int>, int, true>)->Name("HashMapFanoutMultiGetFlat")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanout<HashMap<LockedReadKey, int>, LockedReadKey, false>)->Name("HashMapFanoutGetLocked")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanout<HashMap<LockedReadKey, int>, LockedReadKey, true>)->Name("HashMapFanoutMultiGetLocked")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+template<typename Map, bool Batched>
+void BM_HashMapFanoutUpsert(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr std::size_t batchSize = 1000u;
+    int amount = static_cast<int>(state.range(0));
+
+    Map map;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> distribution(0, amount - 1);
+    std::vector<std::pair<int, int>> elements(batchSize);
+    std::generate(elements.begin(), elements.end(), [&]() { return std::pair(distribution(generator), 1); });
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        if constexpr (Batched)
+        {
+            map.MultiUpsert(elements);
+        }
+        else
+        {
+            for (const auto& [key, value] : elements)
+            {
+                map.AddOrUpdate(key, value);
+            }
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * batchSize);
+}
+BENCHMARK(BM_HashMapFanoutUpsert<HashMap<int, int>, false>)->Name("HashMapFanoutAddOrUpdateChained")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanoutUpsert<HashMap<int, int>, true>)->Name("HashMapFanoutMultiUpsertChained")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanoutUpsert<FlatHashMap<int, int>, false>)->Name("HashMapFanoutAddOrUpdateFlat")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_HashMapFanoutUpsert<FlatHashMap<int, int>, true>)->Name("HashMapFanoutMultiUpsertFlat")->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+int GetMaxBenchmarkThreads()
+{
+    return static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+}
+
+// Read-modify-write of counters, either as Get followed by AddOrUpdate or as a single Upsert
+template<bool Atomic>
+void BM_HashMapIncrement(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    static HashMap<int, long long> map;
+    constexpr int amountOfKeys = 1024;
+    int key = state.thread_index();
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        key = (key + 1) % amountOfKeys;
+
+        if constexpr (Atomic)
+        {
+            map.Upsert(key, [](long long& value) { value++; }, 1);
+        }
+        else
+        {
+            map.AddOrUpdate(key, map.Get(key) + 1);
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HashMapIncrement<false>)->Name("HashMapIncrementGetAddOrUpdate")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapIncrement<true>)->Name("HashMapIncrementUpsert")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+
+// Lookups of string_view keys, which either have to be copied to a std::string or go through StringHash
+template<typename Map>
+void BM_HashMapStringViewGet(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr int amountOfKeys = 4096;
+
+    Map map;
+    std::vector<std::string> storage;
+    for (int key = 0; key < amountOfKeys; key++)
+    {
+        storage.push_back("session-key-with-some-prefix-" + std::to_string(key));
+        map.AddOrUpdate(storage.back(), key);
+    }
+
+    std::vector<std::string_view> keys(storage.begin(), storage.end());
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        for (std::string_view key : keys)
+        {
+            if constexpr (IsTransparent<typename Map::HashType>::value)
+            {
+                benchmark::DoNotOptimize(map.Get(key));
+            }
+            else
+            {
+                benchmark::DoNotOptimize(map.Get(std::string(key)));
+            }
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * amountOfKeys);
+}
+BENCHMARK(BM_HashMapStringViewGet<HashMap<std::string, int>>)->Name("HashMapStringViewGetCopy");
+BENCHMARK(BM_HashMapStringViewGet<HashMap<std::string, int, 17u, StringHash>>)->Name("HashMapStringViewGetTransparent");
+
+template<typename Map, typename Key, int ReadPercent>
+void BM_HashMapReadMostly(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr int amountOfKeys = 1 << 16;
+    static std::unique_ptr<Map> map;
+
+    if (state.thread_index() == 0)
+    {
+        map = std::make_unique<Map>();
+
+        for (int key = 0; key < amountOfKeys; key++)
+        {
+            map->AddOrUpdate(Key(key), key);
+        }
+    }
+
+    std::mt19937 generator(state.thread_index());
+    std::uniform_int_distribution<int> keyDistribution(0, amountOfKeys - 1);
+    std::uniform_int_distribution<int> percentDistribution(0, 99);
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        int key = keyDistribution(generator);
+
+        if (percentDistribution(generator) < ReadPercent)
+        {
+            benchmark::DoNotOptimize(map->Get(Key(key)));
+        }
+        else
+        {
+            map->AddOrUpdate(Key(key), key);
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        map.reset();
+    }
+}
+BENCHMARK(BM_HashMapReadMostly<HashMap<int, int>, int, 99>)->Name("HashMapOptimisticRead99")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<HashMap<LockedReadKey, int>, LockedReadKey, 99>)->Name("HashMapLockedRead99")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<HashMap<int, int>, int, 90>)->Name("HashMapOptimisticRead90")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<HashMap<LockedReadKey, int>, LockedReadKey, 90>)->Name("HashMapLockedRead90")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<FlatHashMap<int, int>, int, 99>)->Name("FlatHashMapOptimisticRead99")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<FlatHashMap<LockedReadKey, int>, LockedReadKey, 99>)->Name("FlatHashMapLockedRead99")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<FlatHashMap<int, int>, int, 90>)->Name("FlatHashMapOptimisticRead90")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<FlatHashMap<LockedReadKey, int>, LockedReadKey, 90>)->Name("FlatHashMapLockedRead90")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+
+// Locked reads with per-thread reader counters instead of the shared_mutex reader count
+using BigReaderHashMap = HashMap<LockedReadKey, int, 17u, std::hash<LockedReadKey>,
+    std::allocator<std::pair<LockedReadKey, int>>, ChainedHashTable, BigReaderMutex>;
+
+BENCHMARK(BM_HashMapReadMostly<BigReaderHashMap, LockedReadKey, 100>)->Name("HashMapBigReaderRead100")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<HashMap<LockedReadKey, int>, LockedReadKey, 100>)->Name("HashMapLockedRead100")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<BigReaderHashMap, LockedReadKey, 99>)->Name("HashMapBigReaderRead99")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_HashMapReadMostly<BigReaderHashMap, LockedReadKey, 90>)->Name("HashMapBigReaderRead90")->
+    ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+
+enum class IterationStrategy
+{
+    CopyState,
+    Visit,
+    VisitConsistent,
+    ParallelVisit
+};
+
+template<IterationStrategy Strategy>
+void BM_HashMapIterate(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    int amount = static_cast<int>(state.range(0));
+
+    HashMap<int, int> map;
+    for (int key = 0; key < amount; key++)
+    {
+        map.AddOrUpdate(key, key);
+    }
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+    double copiedBytes = 0.0;
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        if constexpr (Strategy == IterationStrategy::CopyState)
+        {
+            auto copy = map.GetCurrentState();
+
+            // Approximation of the copy footprint: a node per element plus the bucket array
+            copiedBytes = static_cast<double>(copy.size() * (sizeof(std::pair<const int, int>) + sizeof(void*)) +
+                copy.bucket_count() * sizeof(void*));
+            benchmark::DoNotOptimize(copy);
+        }
+        else if constexpr (Strategy == IterationStrategy::ParallelVisit)
+        {
+            std::atomic<long long> sum = 0;
+            map.ParallelForEach(pool, [&sum](int, int value)
+            {
+                sum.fetch_add(value, std::memory_order_relaxed);
+            });
+            benchmark::DoNotOptimize(sum.load());
+        }
+        else
+        {
+            IterationMode mode = Strategy == IterationStrategy::Visit ? IterationMode::PerBucket : IterationMode::Consistent;
+            long long sum = 0;
+
+            map.ForEach([&sum](int, int value)
+            {
+                sum += value;
+            }, mode);
+            benchmark::DoNotOptimize(sum);
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.counters["copied_bytes"] = copiedBytes;
+    state.SetItemsProcessed(state.iterations() * amount);
+}
+BENCHMARK(BM_HashMapIterate<IterationStrategy::CopyState>)->Name("HashMapGetCurrentState")->
+    RangeMultiplier(16)->Range(1 << 12, 1 << 20)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_HashMapIterate<IterationStrategy::Visit>)->Name("HashMapForEach")->
+    RangeMultiplier(16)->Range(1 << 12, 1 << 20)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_HashMapIterate<IterationStrategy::VisitConsistent>)->Name("HashMapForEachConsistent")->
+    RangeMultiplier(16)->Range(1 << 12, 1 << 20)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_HashMapIterate<IterationStrategy::ParallelVisit>)->Name("HashMapParallelForEach")->
+    RangeMultiplier(16)->Range(1 << 12, 1 << 20)->Unit(benchmark::kMicrosecond);
+
+template<typename Duration>
+std::int64_t ToNanoseconds(Duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+void ReportPercentiles(benchmark::State& state, std::vector<std::int64_t>& samples, const std::string& prefix)
+{
+    if (samples.empty())
+    {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    auto percentile = [&samples](double fraction)
+    {
+        return static_cast<double>(samples[static_cast<std::size_t>(fraction * (samples.size() - 1))]);
+    };
+
+    state.counters[prefix + "_p50_ns"] = percentile(0.5);
+    state.counters[prefix + "_p99_ns"] = percentile(0.99);
+    state.counters[prefix + "_p999_ns"] = percentile(0.999);
+    state.counters[prefix + "_max_ns"] = static_cast<double>(samples.back());
+}
+
+// One thread grows the map from empty to range(0) keys, while another one keeps looking up
+// already inserted keys, latency of both operations is sampled to expose rehashing pauses
+void BM_HashMapGrowth(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr int sampleEvery = 16;
+    int amount = static_cast<int>(state.range(0));
+
+    std::vector<std::int64_t> insertLatencies;
+    std::vector<std::int64_t> lookupLatencies;
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        HashMap<int, int> map;
+        std::atomic<int> inserted = 0;
+
+        insertLatencies.clear();
+        lookupLatencies.clear();
+        insertLatencies.reserve(amount / sampleEvery + 1);
+
+        std::thread reader([&map, &inserted, &lookupLatencies, amount]()
+        {
+            std::mt19937 generator(42);
+            int current = 0;
+            int lookups = 0;
+
+            while ((current = inserted.load(std::memory_order_acquire)) < amount)
+            {
+                if (current == 0)
+                {
+                    continue;
+                }
+
+                int key = std::uniform_int_distribution<int>(0, current - 1)(generator);
+
+                if (lookups++ % sampleEvery == 0)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    benchmark::DoNotOptimize(map.Get(key));
+                    lookupLatencies.push_back(ToNanoseconds(std::chrono::steady_clock::now() - start));
+                }
+                else
+                {
+                    benchmark::DoNotOptimize(map.Get(key));
+                }
+            }
+        });
+
+        for (int key = 0; key < amount; key++)
+        {
+            if (key % sampleEvery == 0)
+            {
+                auto start = std::chrono::steady_clock::now();
+                map.AddOrUpdate(key, key);
+                insertLatencies.push_back(ToNanoseconds(std::chrono::steady_clock::now() - start));
+            }
+            else
+            {
+                map.AddOrUpdate(key, key);
+            }
+
+            inserted.store(key + 1, std::memory_order_release);
+        }
+
+        reader.join();
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+
+    ReportPercentiles(state, lookupLatencies, "get");
+    ReportPercentiles(state, insertLatencies, "insert");
+}
+BENCHMARK(BM_HashMapGrowth)->Name("HashMapGrowth")->RangeMultiplier(10)->Range(1000, 10'000'000)->
+    Iterations(1)->Unit(benchmark::kMillisecond);
+
+// Zipfian distribution over [0, n) as in YCSB (Gray et al.), the zeta constant is computed once
+class ZipfianGenerator
+{
+public:
+    ZipfianGenerator(std::size_t n, double theta = 0.99) :
+        n(n), theta(theta)
+    {
+        for (std::size_t i = 1; i <= n; i++)
+        {
+            zetaN += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - std::pow(2.0 / static_cast<double>(n), 1.0 - theta)) / (1.0 - zeta2 / zetaN);
+    }
+
+    template<typename Generator>
+    std::size_t operator()(Generator& generator) const
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+        double uz = u * zetaN;
+
+        if (uz < 1.0)
+        {
+            return 0;
+        }
+
+        if (uz < 1.0 + std::pow(0.5, theta))
+        {
+            return 1;
+        }
+
+        return std::min(n - 1, static_cast<std::size_t>(static_cast<double>(n) * std::pow(eta * u - eta + 1.0, alpha)));
+    }
+
+private:
+    std::size_t n;
+    double theta;
+    double zetaN = 0.0;
+    double alpha = 0.0;
+    double eta = 0.0;
+};
+
+// The usual workaround the cache replaces: a global mutex around a list and an unordered_map
+class MutexLruCache
+{
+public:
+    explicit MutexLruCache(std::size_t capacity) :
+        capacity(capacity)
+    { }
+
+    template<typename Factory>
+    int GetOrCompute(int key, Factory factory)
+    {
+        std::scoped_lock lock(mutex);
+
+        if (auto it = positions.find(key); it != positions.end())
+        {
+            order.splice(order.begin(), order, it->second);
+            hits++;
+            return it->second->second;
+        }
+
+        if (positions.size() == capacity)
+        {
+            positions.erase(order.back().first);
+            order.pop_back();
+        }
+
+        order.emplace_front(key, factory());
+        positions[key] = order.begin();
+
+        return order.front().second;
+    }
+
+    std::size_t GetHits()
+    {
+        std::scoped_lock lock(mutex);
+        return hits;
+    }
+
+private:
+    std::mutex mutex;
+    std::size_t capacity;
+    std::size_t hits = 0;
+    std::list<std::pair<int, int>> order;
+    std::unordered_map<int, std::list<std::pair<int, int>>::iterator> positions;
+};
+
+constexpr std::size_t cacheKeySpace = 1u << 20;
+constexpr std::size_t cacheCapacity = cacheKeySpace / 10;
+
+const ZipfianGenerator& GetCacheKeyGenerator()
+{
+    static ZipfianGenerator generator(cacheKeySpace);
+    return generator;
+}
+
+// Every miss fills the cache, the hit rate of CLOCK is expected to stay close to LRU
+template<typename CacheType>
+void BM_CacheZipfian(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    static std::unique_ptr<CacheType> cache;
+    const ZipfianGenerator& keyGenerator = GetCacheKeyGenerator();
+
+    if (state.thread_index() == 0)
+    {
+        cache = std::make_unique<CacheType>(cacheCapacity);
+    }
+
+    std::mt19937_64 generator(state.thread_index());
+    std::size_t hits = 0;
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        int key = static_cast<int>(keyGenerator(generator));
+        bool miss = false;
+
+        benchmark::DoNotOptimize(cache->GetOrCompute(key, [key, &miss]()
+        {
+            miss = true;
+            return key;
+        }));
+
+        hits += miss ? 0 : 1;
+    }
+
+    perfCounters.Stop();
+
+    state.counters["hit_rate"] = benchmark::Counter(static_cast<double>(hits) / static_cast<double>(state.iterations()),
+        benchmark::Counter::kAvgThreads);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheZipfian<Cache<int, int>>)->Name("CacheZipfianClock")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_CacheZipfian<Cache<int, int, 17u, std::hash<int>, std::allocator<std::pair<int, int>>, FlatHashTable>>)->
+    Name("CacheZipfianClockFlat")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_CacheZipfian<MutexLruCache>)->Name("CacheZipfianMutexLru")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+
+// std::shared_mutex that counts how often it was taken and how often it had to wait, every
+// instance registers itself so the counts of all buckets of a map can be read per shard
+class ContentionCountingMutex
+{
+public:
+    ContentionCountingMutex()
+    {
+        std::scoped_lock lock(registryMutex);
+        registry.push_back(this);
+    }
+
+    ~ContentionCountingMutex()
+    {
+        std::scoped_lock lock(registryMutex);
+        registry.erase(std::find(registry.begin(), registry.end(), this));
+    }
+
+    ContentionCountingMutex(const ContentionCountingMutex&) = delete;
+    ContentionCountingMutex(ContentionCountingMutex&&) = delete;
+
+    ContentionCountingMutex& operator=(const ContentionCountingMutex&) = delete;
+    ContentionCountingMutex& operator=(ContentionCountingMutex&&) = delete;
+
+    void lock()
+    {
+        if (!mutex.try_lock())
+        {
+            contended.fetch_add(1, std::memory_order_relaxed);
+            mutex.lock();
+        }
+
+        acquired.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_lock()
+    {
+        if (!mutex.try_lock())
+        {
+            return false;
+        }
+
+        acquired.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock()
+    {
+        mutex.unlock();
+    }
+
+    void lock_shared()
+    {
+        if (!mutex.try_lock_shared())
+        {
+            contended.fetch_add(1, std::memory_order_relaxed);
+            mutex.lock_shared();
+        }
+
+        acquired.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_lock_shared()
+    {
+        if (!mutex.try_lock_shared())
+        {
+            return false;
+        }
+
+        acquired.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock_shared()
+    {
+        mutex.unlock_shared();
+    }
+
+    // Counts of the live mutexes in construction order, which for a map is the bucket order
+    static std::vector<std::pair<std::uint64_t, std::uint64_t>> GetCounts()
+    {
+        std::scoped_lock lock(registryMutex);
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> counts;
+
+        for (const ContentionCountingMutex* mutex : registry)
+        {
+            counts.emplace_back(mutex->acquired.load(std::memory_order_relaxed), mutex->contended.load(std::memory_order_relaxed));
+        }
+
+        return counts;
+    }
+
+    static void ResetCounts()
+    {
+        std::scoped_lock lock(registryMutex);
+
+        for (ContentionCountingMutex* mutex : registry)
+        {
+            mutex->acquired.store(0, std::memory_order_relaxed);
+            mutex->contended.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static inline std::mutex registryMutex;
+    static inline std::vector<ContentionCountingMutex*> registry;
+
+    std::shared_mutex mutex;
+    std::atomic<std::uint64_t> acquired{ 0 };
+    std::atomic<std::uint64_t> contended{ 0 };
+};
+
+// Trivially copyable key and value of a given size, only the first word takes part in the hash
+// but equality compares all of them
+template<std::size_t Bytes>
+struct WideKey
+{
+    explicit WideKey(int key = 0)
+    {
+        words.fill(static_cast<std::uint32_t>(key));
+    }
+
+    bool operator==(const WideKey& other) const
+    {
+        return words == other.words;
+    }
+
+    std::array<std::uint32_t, Bytes / sizeof(std::uint32_t)> words;
+};
+
+struct WideKeyHash
+{
+    template<std::size_t Bytes>
+    std::size_t operator()(const WideKey<Bytes>& key) const
+    {
+        return std::hash<std::uint32_t>()(key.words[0]);
+    }
+};
+
+template<std::size_t Bytes>
+struct WideValue
+{
+    explicit WideValue(int value = 0)
+    {
+        bytes.fill(static_cast<char>(value));
+    }
+
+    std::array<char, Bytes> bytes;
+};
+
+constexpr std::size_t contentionKeySpace = 1u << 16;
+
+const ZipfianGenerator& GetContentionKeyGenerator()
+{
+    static ZipfianGenerator generator(contentionKeySpace);
+    return generator;
+}
+
+// Mix of Get, AddOrUpdate and Erase given as read and write percentages, the rest erases, over
+// uniform or Zipfian keys. Next to ops/s it reports lock acquisitions per operation, the share of
+// acquisitions that had to wait, and the share of all waits that fell on the most contended
+// bucket: waits spread over buckets call for more of them, waits on one bucket for a hot key
+template<typename Map, typename Key, typename Value>
+void BM_HashMapContention(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    static std::unique_ptr<Map> map;
+
+    int readPercent = static_cast<int>(state.range(0));
+    int writePercent = static_cast<int>(state.range(1));
+    bool zipfian = state.range(2) != 0;
+    const ZipfianGenerator& zipfianGenerator = GetContentionKeyGenerator();
+
+    if (state.thread_index() == 0)
+    {
+        map = std::make_unique<Map>();
+
+        for (std::size_t key = 0; key < contentionKeySpace; key++)
+        {
+            map->AddOrUpdate(Key(static_cast<int>(key)), Value(static_cast<int>(key)));
+        }
+
+        ContentionCountingMutex::ResetCounts();
+    }
+
+    std::mt19937_64 generator(state.thread_index());
+    std::uniform_int_distribution<std::size_t> keyDistribution(0, contentionKeySpace - 1);
+    std::uniform_int_distribution<int> percentDistribution(0, 99);
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        int key = static_cast<int>(zipfian ? zipfianGenerator(generator) : keyDistribution(generator));
+        int operation = percentDistribution(generator);
+
+        if (operation < readPercent)
+        {
+            benchmark::DoNotOptimize(map->Get(Key(key)));
+        }
+        else if (operation < readPercent + writePercent)
+        {
+            map->AddOrUpdate(Key(key), Value(key));
+        }
+        else
+        {
+            map->Erase(Key(key));
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations());
+
+    // Every thread runs the same amount of iterations, and all of them are done here
+    if (state.thread_index() == 0)
+    {
+        std::uint64_t acquired = 0;
+        std::uint64_t contended = 0;
+        std::uint64_t hottest = 0;
+
+        for (const auto& [shardAcquired, shardContended] : ContentionCountingMutex::GetCounts())
+        {
+            acquired += shardAcquired;
+            contended += shardContended;
+            hottest = std::max(hottest, shardContended);
+        }
+
+        double operations = static_cast<double>(state.iterations()) * state.threads();
+
+        state.counters["locks_per_op"] = static_cast<double>(acquired) / operations;
+        state.counters["contended_pct"] = acquired ? 100.0 * static_cast<double>(contended) / static_cast<double>(acquired) : 0.0;
+        state.counters["hot_shard_pct"] = contended ? 100.0 * static_cast<double>(hottest) / static_cast<double>(contended) : 0.0;
+
+        map.reset();
+    }
+}
+
+// Read-mostly, mixed and write-heavy operations over uniform and Zipfian keys
+template<typename Benchmark>
+void AddHashMapContentionArguments(Benchmark* benchmark)
+{
+    benchmark->ArgNames({ "read", "write", "zipfian" });
+
+    for (std::int64_t zipfian : { 0, 1 })
+    {
+        benchmark->Args({ 95, 5, zipfian });
+        benchmark->Args({ 50, 40, zipfian });
+        benchmark->Args({ 0, 50, zipfian });
+    }
+
+    benchmark->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+}
+
+template<typename Key, typename Value, std::size_t Size, template<typename, typename, typename> typename Table,
+    typename Hash = std::hash<Key>>
+using ContentionHashMap = HashMap<Key, Value, Size, Hash, std::allocator<std::pair<Key, Value>>, Table, ContentionCountingMutex>;
+
+BENCHMARK(BM_HashMapContention<ContentionHashMap<int, int, 17u, ChainedHashTable>, int, int>)->
+    Name("HashMapContentionChained17")->Apply(AddHashMapContentionArguments);
+BENCHMARK(BM_HashMapContention<ContentionHashMap<int, int, 257u, ChainedHashTable>, int, int>)->
+    Name("HashMapContentionChained257")->Apply(AddHashMapContentionArguments);
+BENCHMARK(BM_HashMapContention<ContentionHashMap<int, int, 17u, FlatHashTable>, int, int>)->
+    Name("HashMapContentionFlat17")->Apply(AddHashMapContentionArguments);
+BENCHMARK(BM_HashMapContention<ContentionHashMap<int, int, 257u, FlatHashTable>, int, int>)->
+    Name("HashMapContentionFlat257")->Apply(AddHashMapContentionArguments);
+BENCHMARK(BM_HashMapContention<ContentionHashMap<WideKey<32>, WideValue<64>, 257u, ChainedHashTable, WideKeyHash>,
+    WideKey<32>, WideValue<64>>)->Name("HashMapContentionChained257Key32Value64")->Apply(AddHashMapContentionArguments);
+BENCHMARK(BM_HashMapContention<ContentionHashMap<WideKey<32>, WideValue<64>, 257u, FlatHashTable, WideKeyHash>,
+    WideKey<32>, WideValue<64>>)->Name("HashMapContentionFlat257Key32Value64")->Apply(AddHashMapContentionArguments);
+
+// What the skip list replaces: std::map behind a reader-writer lock
+class LockedOrderedMap
+{
+public:
+    bool Insert(int key, int value)
+    {
+        std::scoped_lock lock(mutex);
+        return map.emplace(key, value).second;
+    }
+
+    bool Erase(int key)
+    {
+        std::scoped_lock lock(mutex);
+        return map.erase(key) != 0;
+    }
+
+    std::optional<int> Find(int key) const
+    {
+        std::shared_lock lock(mutex);
+        auto it = map.find(key);
+        return it != map.end() ? std::optional<int>(it->second) : std::nullopt;
+    }
+
+    long long SumRange(int first, int amount) const
+    {
+        std::shared_lock lock(mutex);
+        long long sum = 0;
+
+        for (auto it = map.lower_bound(first); it != map.end() && amount-- > 0; ++it)
+        {
+            sum += it->second;
+        }
+
+        return sum;
+    }
+
+private:
+    mutable std::shared_mutex mutex;
+    std::map<int, int> map;
+};
+
+class SkipListOrderedMap : public LockFree::SkipListMap<int, int>
+{
+public:
+    long long SumRange(int first, int amount) const
+    {
+        long long sum = 0;
+
+        for (auto it = LowerBound(first); it != end() && amount-- > 0; ++it)
+        {
+            sum += it->second;
+        }
+
+        return sum;
+    }
+};
+
+constexpr int orderedMapKeys = 1 << 16;
+
+// Point operations: 80% Find, 10% Insert, 10% Erase over a half full key range
+template<typename OrderedMap>
+void BM_OrderedMapPoint(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    static std::unique_ptr<OrderedMap> map;
+
+    if (state.thread_index() == 0)
+    {
+        map = std::make_unique<OrderedMap>();
+
+        for (int key = 0; key < orderedMapKeys; key += 2)
+        {
+            map->Insert(key, key);
+        }
+    }
+
+    std::mt19937 generator(state.thread_index());
+    std::uniform_int_distribution<int> keyDistribution(0, orderedMapKeys - 1);
+    std::uniform_int_distribution<int> percentDistribution(0, 99);
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        int key = keyDistribution(generator);
+        int percent = percentDistribution(generator);
+
+        if (percent < 80)
+        {
+            benchmark::DoNotOptimize(map->Find(key));
+        }
+        else if (percent < 90)
+        {
+            benchmark::DoNotOptimize(map->Insert(key, key));
+        }
+        else
+        {
+            benchmark::DoNotOptimize(map->Erase(key));
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        map.reset();
+    }
+}
+BENCHMARK(BM_OrderedMapPoint<SkipListOrderedMap>)->Name("OrderedMapPointSkipList")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_OrderedMapPoint<LockedOrderedMap>)->Name("OrderedMapPointLockedMap")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+
+// Range scans of 100 elements, the first thread keeps inserting and erasing meanwhile
+template<typename OrderedMap>
+void BM_OrderedMapRange(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    constexpr int rangeLength = 100;
+    static std::unique_ptr<OrderedMap> map;
+
+    if (state.thread_index() == 0)
+    {
+        map = std::make_unique<OrderedMap>();
+
+        for (int key = 0; key < orderedMapKeys; key += 2)
+        {
+            map->Insert(key, key);
+        }
+    }
+
+    std::mt19937 generator(state.thread_index());
+    std::uniform_int_distribution<int> keyDistribution(0, orderedMapKeys - 1);
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        int key = keyDistribution(generator);
+
+        if (state.thread_index() == 0 && state.threads() > 1)
+        {
+            if (!map->Insert(key, key))
+            {
+                map->Erase(key);
+            }
+        }
+        else
+        {
+            benchmark::DoNotOptimize(map->SumRange(key, rangeLength));
+        }
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        map.reset();
+    }
+}
+BENCHMARK(BM_OrderedMapRange<SkipListOrderedMap>)->Name("OrderedMapRangeSkipList")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_OrderedMapRange<LockedOrderedMap>)->Name("OrderedMapRangeLockedMap")->ThreadRange(1, GetMaxBenchmarkThreads())->UseRealTime();
+
+enum class KeyDistribution
+{
+    Uniform,
+    Zipfian,
+    FewUnique,
+    Sorted,
+    Reversed,
+    // Sorted with one percent of the elements swapped to random places
+    NearlySorted
+};
+
+template<KeyDistribution distribution>
+const std::vector<int>& GetSortInput(std::size_t length)
+{
+    static std::vector<int> input;
+
+    if (input.size() != length)
+    {
+        std::mt19937 generator(42);
+        std::uniform_int_distribution<int> uniform;
+        static ZipfianGenerator zipfian(1 << 20);
+
+        input.resize(length);
+
+        for (auto& value : input)
+        {
+            switch (distribution)
+            {
+            case KeyDistribution::Uniform:
+                value = uniform(generator);
+                break;
+            case KeyDistribution::Zipfian:
+                value = static_cast<int>(zipfian(generator));
+                break;
+            case KeyDistribution::FewUnique:
+                value = uniform(generator) % 16;
+                break;
+            default:
+                value = uniform(generator);
+                break;
+            }
+        }
+
+        if (distribution == KeyDistribution::Sorted || distribution == KeyDistribution::Reversed ||
+            distribution == KeyDistribution::NearlySorted)
+        {
+            std::sort(input.begin(), input.end());
+        }
+
+        if (distribution == KeyDistribution::Reversed)
+        {
+            std::reverse(input.begin(), input.end());
+        }
+
+        if (distribution == KeyDistribution::NearlySorted)
+        {
+            std::uniform_int_distribution<std::size_t> position(0, length - 1);
+
+            for (std::size_t i = 0; i < length / 200; i++)
+            {
+                std::swap(input[position(generator)], input[position(generator)]);
+            }
+        }
+    }
+
+    return input;
+}
+
+template<void (*Algo)(Iterator, Iterator, std::less<>)>
+void WithoutPool(Iterator begin, Iterator end, ThreadPool&, std::less<> comp)
+{
+    Algo(begin, end, comp);
+}
+
+template<void (*Algo)(Iterator, Iterator, ThreadPool&, std::less<>), KeyDistribution distribution>
+void BM_SortDistribution(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    const std::vector<int>& input = GetSortInput<distribution>(state.range(0));
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<int> copy = input;
+
+        Algo(copy.begin(), copy.end(), pool, std::less<>());
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SortDistribution<&ParallelSampleSort<Iterator, ThreadPool>, KeyDistribution::Uniform>)->
+    Name("SortUniformSampleSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::Uniform>)->
+    Name("SortUniformMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&ParallelMergeSortWithBufferCountThreads<Iterator>>, KeyDistribution::Uniform>)->
+    Name("SortUniformMergeSortLimitThreads")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&ParallelMergeSort<Iterator>>, KeyDistribution::Uniform>)->
+    Name("SortUniformMergeSortInplace")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelSampleSort<Iterator, ThreadPool>, KeyDistribution::Zipfian>)->
+    Name("SortZipfianSampleSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::Zipfian>)->
+    Name("SortZipfianMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&ParallelMergeSortWithBufferCountThreads<Iterator>>, KeyDistribution::Zipfian>)->
+    Name("SortZipfianMergeSortLimitThreads")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&ParallelMergeSort<Iterator>>, KeyDistribution::Zipfian>)->
+    Name("SortZipfianMergeSortInplace")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelSampleSort<Iterator, ThreadPool>, KeyDistribution::FewUnique>)->
+    Name("SortFewUniqueSampleSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::FewUnique>)->
+    Name("SortFewUniqueMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&ParallelMergeSortWithBufferCountThreads<Iterator>>, KeyDistribution::FewUnique>)->
+    Name("SortFewUniqueMergeSortLimitThreads")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&ParallelMergeSort<Iterator>>, KeyDistribution::FewUnique>)->
+    Name("SortFewUniqueMergeSortInplace")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelAdaptiveMergeSort<Iterator, ThreadPool>, KeyDistribution::Sorted>)->
+    Name("SortSortedParallelAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&AdaptiveMergeSort<Iterator>>, KeyDistribution::Sorted>)->
+    Name("SortSortedAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::Sorted>)->
+    Name("SortSortedMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&MergeSort<Iterator>>, KeyDistribution::Sorted>)->
+    Name("SortSortedMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelAdaptiveMergeSort<Iterator, ThreadPool>, KeyDistribution::Reversed>)->
+    Name("SortReversedParallelAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&AdaptiveMergeSort<Iterator>>, KeyDistribution::Reversed>)->
+    Name("SortReversedAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::Reversed>)->
+    Name("SortReversedMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&MergeSort<Iterator>>, KeyDistribution::Reversed>)->
+    Name("SortReversedMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelAdaptiveMergeSort<Iterator, ThreadPool>, KeyDistribution::NearlySorted>)->
+    Name("SortNearlySortedParallelAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&AdaptiveMergeSort<Iterator>>, KeyDistribution::NearlySorted>)->
+    Name("SortNearlySortedAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::NearlySorted>)->
+    Name("SortNearlySortedMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&MergeSort<Iterator>>, KeyDistribution::NearlySorted>)->
+    Name("SortNearlySortedMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelAdaptiveMergeSort<Iterator, ThreadPool>, KeyDistribution::Uniform>)->
+    Name("SortRandomParallelAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&AdaptiveMergeSort<Iterator>>, KeyDistribution::Uniform>)->
+    Name("SortRandomAdaptiveMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&ParallelMergeSortThreadPool<Iterator, ThreadPool>, KeyDistribution::Uniform>)->
+    Name("SortRandomMergeSortThreadPool")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_SortDistribution<&WithoutPool<&MergeSort<Iterator>>, KeyDistribution::Uniform>)->
+    Name("SortRandomMergeSort")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+void StdPartialSort(Iterator begin, Iterator middle, Iterator end, ThreadPool&, std::less<> comp)
+{
+    std::partial_sort(begin, middle, end, comp);
+}
+
+void StdNthElement(Iterator begin, Iterator nth, Iterator end, ThreadPool&, std::less<> comp)
+{
+    std::nth_element(begin, nth, end, comp);
+}
+
+void FullParallelSort(Iterator begin, Iterator, Iterator end, ThreadPool& pool, std::less<> comp)
+{
+    ParallelMergeSortThreadPool(begin, end, pool, comp);
+}
+
+// Selects the state.range(1) smallest of state.range(0) uniform ints
+template<void (*Algo)(Iterator, Iterator, Iterator, ThreadPool&, std::less<>)>
+void BM_PartialSort(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    const std::vector<int>& input = GetSortInput<KeyDistribution::Uniform>(state.range(0));
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<int> copy = input;
+
+        Algo(copy.begin(), copy.begin() + state.range(1), copy.end(), pool, std::less<>());
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PartialSort<&ParallelPartialSort<Iterator, ThreadPool>>)->Name("PartialSortParallel")->
+    Args({ 1 << 24, 1000 })->Args({ 1 << 24, 1 << 20 })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_PartialSort<&StdPartialSort>)->Name("PartialSortStd")->
+    Args({ 1 << 24, 1000 })->Args({ 1 << 24, 1 << 20 })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_PartialSort<&FullParallelSort>)->Name("PartialSortFullSort")->
+    Args({ 1 << 24, 1000 })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_PartialSort<&ParallelNthElement<Iterator, ThreadPool>>)->Name("NthElementParallel")->
+    Args({ 1 << 24, 1000 })->Args({ 1 << 24, 1 << 23 })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_PartialSort<&StdNthElement>)->Name("NthElementStd")->
+    Args({ 1 << 24, 1000 })->Args({ 1 << 24, 1 << 23 })->Unit(benchmark::kMillisecond)->UseRealTime();
+
+#ifdef TRACE_SPANS
+// Records spans of a pool merge sort and a ParallelForEach, the timeline of the last run is exported
+// to merge-sort-spans.json in the temp directory for chrome://tracing or ui.perfetto.dev
+void BM_MergeSortSpans(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    const std::vector<int>& input = GetSortInput<KeyDistribution::Uniform>(state.range(0));
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    std::filesystem::path tracePath = std::filesystem::temp_directory_path() / "merge-sort-spans.bin";
+    std::filesystem::path jsonPath = std::filesystem::temp_directory_path() / "merge-sort-spans.json";
+
+    Tracing::StartSpans(tracePath.string());
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<int> copy = input;
+
+        ParallelMergeSortThreadPool(copy.begin(), copy.end(), pool);
+        ParallelForEach(copy.begin(), copy.end(), [](int& value) { value++; });
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+
+    Tracing::StopSpans();
+    Tracing::ExportChromeTrace(tracePath.string(), jsonPath.string());
+    std::filesystem::remove(tracePath);
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetLabel(jsonPath.string());
+}
+BENCHMARK(BM_MergeSortSpans)->Name("MergeSortSpans")->Arg(1 << 22)->Unit(benchmark::kMillisecond)->UseRealTime();
+#endif
+
+struct ExternalRecord
+{
+    std::uint64_t key;
+    char payload[56];
+};
+
+// Input size in MB, the sort gets a sixteenth of it as memory so it has to merge several runs
+void BM_ExternalSort(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    namespace fs = std::filesystem;
+
+    std::size_t bytes = static_cast<std::size_t>(state.range(0)) << 20;
+    fs::path directory = fs::temp_directory_path();
+    fs::path input = directory / "external-sort-benchmark-input";
+    fs::path output = directory / "external-sort-benchmark-output";
+
+    {
+        std::vector<ExternalRecord> records(bytes / sizeof(ExternalRecord));
+        std::mt19937_64 generator(42);
+
+        for (auto& record : records)
+        {
+            record.key = generator();
+        }
+
+        std::ofstream file(input, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ExternalRecord));
+    }
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+    ExternalSortOptions options;
+    options.memoryBytes = bytes / 16;
+    options.ioBufferBytes = options.memoryBytes / 32;
+
+    auto compareKeys = [](const ExternalRecord& left, const ExternalRecord& right)
+    {
+        return left.key < right.key;
+    };
+
+    ExternalSortStatistics statistics;
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        statistics = ExternalSort<ExternalRecord>(input, output, pool, compareKeys, options);
+    }
+
+    perfCounters.Stop();
+
+    state.SetBytesProcessed(state.iterations() * bytes);
+    state.counters["runs"] = static_cast<double>(statistics.runs);
+    state.counters["merge_passes"] = static_cast<double>(statistics.mergePasses);
+
+    fs::remove(input);
+    fs::remove(output);
+}
+BENCHMARK(BM_ExternalSort)->Name("ExternalSort")->Arg(64)->Arg(256)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+struct PoolStrategy
+{
+    PoolStrategy() :
+        pool(std::thread::hardware_concurrency())
+    { }
+
+    ThreadPool pool;
+
+    void Run(std::vector<int>& data)
+    {
+        std::vector<std::future<void>> futures;
+        futures.reserve(data.size());
+
+        for (std::size_t i = 0; i < data.size(); i++)
+        {
+            futures.push_back(pool.Enqueue([&data, i]() { data[i]++; }));
+        }
+
+        for (std::size_t i = 0; i < futures.size(); i++)
+        {
+            futures[i].wait();
+        }
+    }
+};
+
+struct ThreadStrategy
+{
+    void Run(std::vector<int>& data)
+    {
+        std::vector<std::thread> threads;
+        threads.reserve(data.size());
+
+        for (std::size_t i = 0; i < data.size(); i++)
+        {
+            threads.emplace_back([&data, i]() { data[i]++; });
+        }
+
+        for (std::size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+        }
+    }
+};
+
+template<typename Strategy>
+void BM_ThreadPool(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    std::vector<int> vec;
+    vec.reserve(state.range(0));
+    Strategy strategy;
+
+    for (int i = state.range(0); i >= 0; i--)
+    {
+        vec.push_back(i);
+    }
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        std::vector<int> copy = vec;
+        
+        strategy.Run(copy);
+
+        benchmark::ClobberMemory();
+    }
+
+    perfCounters.Stop();
+}
+BENCHMARK(BM_ThreadPool<ThreadStrategy>)->Name("CreateThreads")->RangeMultiplier(2)->Range(1 << 8, 1 << 10);
+BENCHMARK(BM_ThreadPool<PoolStrategy>)->Name("CreateThreadPool")->RangeMultiplier(2)->Range(1 << 8, 1 << 10);
+
+inline constexpr std::size_t pipelineBlocks = 1 << 10;
+inline constexpr std::size_t pipelineBlockLength = 1 << 12;
+
+// Token of the streaming pipeline, its buffer is allocated once and reused for every block
+struct PipelineBlock
+{
+    std::size_t index = 0;
+    std::vector<std::uint32_t> values;
+    std::uint64_t checksum = 0;
+};
+
+// Generate (source), hash every value (parallel), sum up (serial out of order) and write
+// checksums (serial in order), with state.range(0) blocks in flight
+void BM_Pipeline(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    ThreadPool pool(std::thread::hardware_concurrency());
+    std::size_t maxTokens = state.range(0);
+
+    std::size_t produced = 0;
+    std::uint64_t total = 0;
+    std::vector<std::uint64_t> output;
+    bool ordered = true;
+
+    Pipeline<PipelineBlock> pipeline([&produced](PipelineBlock& block)
+    {
+        if (produced == pipelineBlocks)
+        {
+            return false;
+        }
+
+        block.index = produced++;
+        block.values.resize(pipelineBlockLength);
+        std::iota(block.values.begin(), block.values.end(), static_cast<std::uint32_t>(block.index * pipelineBlockLength));
+
+        return true;
+    });
+
+    pipeline.AddStage(StageMode::Parallel, [](PipelineBlock& block)
+    {
+        block.checksum = 0;
+
+        for (std::uint32_t& value : block.values)
+        {
+            value *= 2654435761u;
+            value ^= value >> 16;
+            block.checksum += value;
+        }
+    }).AddStage(StageMode::SerialOutOfOrder, [&total](PipelineBlock& block)
+    {
+        total += block.checksum;
+    }).AddStage(StageMode::SerialInOrder, [&output, &ordered](PipelineBlock& block)
+    {
+        ordered = ordered && block.index == output.size();
+        output.push_back(block.checksum);
+    });
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        produced = 0;
+        total = 0;
+        output.clear();
+
+        pipeline.Run(pool, maxTokens);
+
+        if (!ordered || output.size() != pipelineBlocks)
+        {
+            state.SkipWithError("Pipeline lost or reordered blocks");
+            break;
+        }
+
+        benchmark::DoNotOptimize(total);
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations() * pipelineBlocks * pipelineBlockLength);
+}
+BENCHMARK(BM_Pipeline)->Name("Pipeline")->ArgName("tokens")->RangeMultiplier(4)->Range(1, 64)->UseRealTime();
+
+using BenchmarkTracer = Tracer<std::size_t(1) << 16>;
+
+void BM_Trace(benchmark::State& state)
+{
+    PerfCounters perfCounters(state);
+
+    static std::unique_ptr<BenchmarkTracer> tracer;
+    static std::filesystem::path path = std::filesystem::temp_directory_path() / "tracer-benchmark.bin";
+
+    if (state.thread_index() == 0)
+    {
+        tracer = std::make_unique<BenchmarkTracer>(path.string());
+    }
+
+    std::uint64_t i = 0;
+
+    perfCounters.Start();
+
+    for (auto _ : state)
+    {
+        tracer->Trace(1, i++, state.thread_index());
+    }
+
+    perfCounters.Stop();
+
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        state.counters["dropped"] = static_cast<double>(tracer->Dropped());
+        tracer.reset();
+        std::filesystem::remove(path);
+    }
+}
+BENCHMARK(BM_Trace)->Name("Trace")->ThreadRange(1, GetMaxBenchmarkThreads());
+
+// Same as BENCHMARK_MAIN, but takes --perf_counters out of the arguments first
+int main(int argc, char** argv)
+{
+    std::vector<char*> arguments;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (std::string_view(argv[i]) == "--perf_counters")
+        {
+            perfCountersEnabled = true;
+        }
+        else
+        {
+            arguments.push_back(argv[i]);
+        }
+    }
+
+#ifdef __linux__
+    if (perfCountersEnabled)
+    {
+        int descriptor = PerfCounters::Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+
+        if (descriptor < 0)
+        {
+            bool denied = errno == EACCES || errno == EPERM;
+
+            std::fprintf(stderr, "Hardware counters are unavailable (%s)%s, only the other counters are reported\n",
+                std::strerror(errno), denied ? ", check /proc/sys/kernel/perf_event_paranoid" : "");
+        }
+        else
+        {
+            close(descriptor);
+        }
+    }
+#else
+    if (perfCountersEnabled)
+    {
+        std::fprintf(stderr, "Counters need perf_event_open, which is Linux only\n");
+    }
+#endif
+
+    int count = static_cast<int>(arguments.size());
+    arguments.push_back(nullptr);
+
+    benchmark::Initialize(&count, arguments.data());
+
+    if (benchmark::ReportUnrecognizedArguments(count, arguments.data()))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
 
-BENCHMARK_MAIN();
\ No newline at end of file
+    return 0;
+}
\ No newline at end of file
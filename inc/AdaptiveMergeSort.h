@@ -0,0 +1,416 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <cstddef>
+
+#include "ThreadPool.h"
+#include "MergeSort.h"
+
+// Shorter natural runs are extended to this length by insertion sort
+inline constexpr std::size_t adaptiveMinRun = 32;
+// Consecutive wins of one side before a merge switches to galloping
+inline constexpr std::size_t adaptiveMinGallop = 7;
+
+struct SortedRun
+{
+    std::size_t begin;
+    std::size_t length;
+};
+
+// Length of the natural run at begin. A strictly descending run is reversed in place,
+// equal elements never make a run descending, so reversing keeps the sort stable
+template<typename Iter, typename Comp>
+std::size_t CountRunAndMakeAscending(Iter begin, Iter end, Comp& comp)
+{
+    Iter runEnd = std::next(begin);
+
+    if (runEnd == end)
+    {
+        return 1;
+    }
+
+    if (comp(*runEnd, *begin))
+    {
+        do
+        {
+            ++runEnd;
+        } while (runEnd != end && comp(*runEnd, *std::prev(runEnd)));
+
+        std::reverse(begin, runEnd);
+    }
+    else
+    {
+        do
+        {
+            ++runEnd;
+        } while (runEnd != end && !comp(*runEnd, *std::prev(runEnd)));
+    }
+
+    return std::distance(begin, runEnd);
+}
+
+// Length of the sorted run made at begin. Short runs are extended to adaptiveMinRun, or to the
+// sorting network length for types that have one, unless the range ends first
+template<typename Iter, typename Comp>
+std::size_t MakeRun(Iter begin, Iter end, Comp& comp)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+    constexpr std::size_t minRun = std::max(adaptiveMinRun, MergeSortCutoff<Value>::value);
+
+    std::size_t length = CountRunAndMakeAscending(begin, end, comp);
+
+    if (length < minRun)
+    {
+        length = std::min<std::size_t>(minRun, std::distance(begin, end));
+        SortSmallRange(begin, begin + length, comp);
+    }
+
+    return length;
+}
+
+// Powersort merge priority of the boundary between adjacent runs: the first bit in which the
+// midpoints of both runs differ, as fractions of the whole length n. Boundaries with smaller
+// powers are merged later, which keeps the merge tree close to balanced in elements
+inline unsigned GetNodePower(std::size_t begin1, std::size_t length1, std::size_t length2, std::size_t n)
+{
+    std::size_t a = 2 * begin1 + length1;
+    std::size_t b = a + length1 + length2;
+    unsigned power = 0;
+
+    while (true)
+    {
+        power++;
+
+        if (a >= n)
+        {
+            a -= n;
+            b -= n;
+        }
+        else if (b >= n)
+        {
+            return power;
+        }
+
+        a <<= 1;
+        b <<= 1;
+    }
+}
+
+// First element greater than value, searched exponentially from the front,
+// so it costs about 2 log d comparisons for an answer at distance d
+template<typename Iter, typename T, typename Comp>
+Iter GallopUpperBound(Iter first, Iter last, const T& value, Comp& comp)
+{
+    std::size_t length = std::distance(first, last);
+    std::size_t previous = 0;
+    std::size_t step = 1;
+
+    while (step <= length && !comp(value, first[step - 1]))
+    {
+        previous = step;
+        step *= 2;
+    }
+
+    return std::upper_bound(first + previous, first + std::min(step - 1, length), value, comp);
+}
+
+// First element not less than value, searched exponentially from the front
+template<typename Iter, typename T, typename Comp>
+Iter GallopLowerBound(Iter first, Iter last, const T& value, Comp& comp)
+{
+    std::size_t length = std::distance(first, last);
+    std::size_t previous = 0;
+    std::size_t step = 1;
+
+    while (step <= length && comp(first[step - 1], value))
+    {
+        previous = step;
+        step *= 2;
+    }
+
+    return std::lower_bound(first + previous, first + std::min(step - 1, length), value, comp);
+}
+
+// Stable merge of adjacent sorted [begin, mid) and [mid, end). Elements already in their
+// final place at both ends are skipped by galloping, the rest of the left run is moved to
+// the buffer. Once one side wins adaptiveMinGallop times in a row the merge gallops,
+// moving whole blocks found by exponential search until blocks get short again
+template<typename Iter, typename Comp, typename Buffer>
+void GallopingMerge(Iter begin, Iter mid, Iter end, Comp& comp, Buffer& buffer)
+{
+    if (begin == mid || mid == end)
+    {
+        return;
+    }
+
+    begin = GallopUpperBound(begin, mid, *mid, comp);
+
+    if (begin == mid)
+    {
+        return;
+    }
+
+    end = GallopLowerBound(mid, end, *std::prev(mid), comp);
+
+    buffer.clear();
+    buffer.insert(buffer.end(), std::make_move_iterator(begin), std::make_move_iterator(mid));
+
+    auto left = buffer.begin();
+    Iter right = mid;
+    Iter out = begin;
+
+    while (left != buffer.end() && right != end)
+    {
+        std::size_t leftWins = 0;
+        std::size_t rightWins = 0;
+
+        while (left != buffer.end() && right != end && leftWins < adaptiveMinGallop && rightWins < adaptiveMinGallop)
+        {
+            if (comp(*right, *left))
+            {
+                *out++ = std::move(*right++);
+                rightWins++;
+                leftWins = 0;
+            }
+            else
+            {
+                *out++ = std::move(*left++);
+                leftWins++;
+                rightWins = 0;
+            }
+        }
+
+        while (left != buffer.end() && right != end)
+        {
+            auto leftStop = GallopUpperBound(left, buffer.end(), *right, comp);
+            std::size_t leftBlock = std::distance(left, leftStop);
+            out = std::move(left, leftStop, out);
+            left = leftStop;
+
+            if (left == buffer.end())
+            {
+                break;
+            }
+
+            Iter rightStop = GallopLowerBound(right, end, *left, comp);
+            std::size_t rightBlock = std::distance(right, rightStop);
+            out = std::move(right, rightStop, out);
+            right = rightStop;
+
+            if (leftBlock < adaptiveMinGallop && rightBlock < adaptiveMinGallop)
+            {
+                break;
+            }
+        }
+    }
+
+    // What is left of the right run is already in place
+    std::move(left, buffer.end(), out);
+}
+
+// Natural merge sort with the powersort merge policy: runs are taken as they are found in
+// the data, descending ones reversed and short ones extended, so sorted and reversed input
+// cost a single pass and nearly sorted input little more. Stable, needs a buffer of at most
+// the length of the range
+template<typename Iter, typename Comp = std::less<>>
+void AdaptiveMergeSort(Iter begin, Iter end, Comp comp = {})
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
+    struct StackRun
+    {
+        SortedRun run;
+        // Power of the boundary to the next run on the stack
+        unsigned power;
+    };
+
+    std::size_t length = std::distance(begin, end);
+    std::vector<StackRun> stack;
+    std::vector<Value> buffer;
+
+    auto mergeTop = [&]()
+    {
+        SortedRun& left = stack[stack.size() - 2].run;
+        SortedRun& right = stack.back().run;
+
+        GallopingMerge(begin + left.begin, begin + right.begin, begin + right.begin + right.length, comp, buffer);
+        left.length += right.length;
+        stack.pop_back();
+    };
+
+    for (std::size_t position = 0; position < length;)
+    {
+        std::size_t runLength = MakeRun(begin + position, end, comp);
+
+        if (!stack.empty())
+        {
+            unsigned power = GetNodePower(stack.back().run.begin, stack.back().run.length, runLength, length);
+
+            while (stack.size() > 1 && stack[stack.size() - 2].power > power)
+            {
+                mergeTop();
+            }
+
+            stack.back().power = power;
+        }
+
+        stack.push_back({ { position, runLength }, 0 });
+        position += runLength;
+    }
+
+    while (stack.size() > 1)
+    {
+        mergeTop();
+    }
+}
+
+// Merges the runs under boundary node of the merge tree, runs [firstRun, lastRun] inclusive.
+// Left subtrees of at least threshold elements run as pool tasks, long merges are split by
+// co-ranking like in the buffered merge sorts
+template<typename Iter, typename Comp, typename ThreadPool>
+void MergeRunTree(Iter begin, const std::vector<SortedRun>& runs, const std::vector<std::ptrdiff_t>& leftChild,
+    const std::vector<std::ptrdiff_t>& rightChild, std::size_t node, std::size_t firstRun, std::size_t lastRun,
+    ThreadPool& pool, Comp comp)
+{
+    auto mergeLeft = [&, node, firstRun]()
+    {
+        if (leftChild[node] >= 0)
+        {
+            MergeRunTree(begin, runs, leftChild, rightChild, leftChild[node], firstRun, node, pool, comp);
+        }
+    };
+
+    std::size_t first = runs[firstRun].begin;
+    std::size_t mid = runs[node + 1].begin;
+    std::size_t last = runs[lastRun].begin + runs[lastRun].length;
+
+    if (mid - first >= threshold && leftChild[node] >= 0)
+    {
+        auto future = pool.Enqueue(mergeLeft);
+
+        if (rightChild[node] >= 0)
+        {
+            MergeRunTree(begin, runs, leftChild, rightChild, rightChild[node], node + 1, lastRun, pool, comp);
+        }
+
+        pool.WaitFor(future);
+        future.get();
+    }
+    else
+    {
+        mergeLeft();
+
+        if (rightChild[node] >= 0)
+        {
+            MergeRunTree(begin, runs, leftChild, rightChild, rightChild[node], node + 1, lastRun, pool, comp);
+        }
+    }
+
+    std::size_t parts = GetMergeParts(last - first, pool.Size());
+
+    if (parts > 1 && comp(begin[mid], begin[mid - 1]))
+    {
+        auto buffer = MoveToBuffer(begin + first, begin + last);
+
+        ParallelMerge(buffer.begin(), buffer.begin() + (mid - first), buffer.end(), begin + first, comp, parts,
+            [&pool](std::size_t parts, auto func)
+            {
+                RunPartsPool(pool, parts, func);
+            });
+    }
+    else
+    {
+        using Value = typename std::iterator_traits<Iter>::value_type;
+        std::vector<Value> buffer;
+
+        GallopingMerge(begin + first, begin + mid, begin + last, comp, buffer);
+    }
+}
+
+// Parallel AdaptiveMergeSort. Chunks are scanned for runs in parallel and runs that continue
+// across a chunk border are joined again. The powersort merge tree over all runs is built
+// as a Cartesian tree of boundary powers, and its independent subtrees merge on the pool
+template<typename Iter, typename ThreadPool, typename Comp = std::less<>>
+void ParallelAdaptiveMergeSort(Iter begin, Iter end, ThreadPool& pool, Comp comp = {})
+{
+    std::size_t length = std::distance(begin, end);
+    std::size_t parts = std::min(length / threshold, pool.Size() + 1);
+
+    if (parts <= 1)
+    {
+        AdaptiveMergeSort(begin, end, comp);
+        return;
+    }
+
+    std::vector<std::vector<SortedRun>> chunkRuns(parts);
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        std::size_t last = length * (part + 1) / parts;
+
+        for (std::size_t position = length * part / parts; position < last;)
+        {
+            std::size_t runLength = MakeRun(begin + position, begin + last, comp);
+            chunkRuns[part].push_back({ position, runLength });
+            position += runLength;
+        }
+    });
+
+    std::vector<SortedRun> runs;
+
+    for (std::size_t part = 0; part < parts; part++)
+    {
+        for (std::size_t i = 0; i < chunkRuns[part].size(); i++)
+        {
+            const SortedRun& run = chunkRuns[part][i];
+
+            if (i == 0 && !runs.empty() && !comp(begin[run.begin], begin[run.begin - 1]))
+            {
+                runs.back().length += run.length;
+            }
+            else
+            {
+                runs.push_back(run);
+            }
+        }
+    }
+
+    if (runs.size() == 1)
+    {
+        return;
+    }
+
+    // Boundary i lies between runs i and i + 1. On equal powers the left boundary is the ancestor,
+    // like in the sequential merge order
+    std::size_t boundaries = runs.size() - 1;
+    std::vector<std::ptrdiff_t> leftChild(boundaries, -1);
+    std::vector<std::ptrdiff_t> rightChild(boundaries, -1);
+    std::vector<unsigned> powers(boundaries);
+    std::vector<std::size_t> path;
+
+    for (std::size_t i = 0; i < boundaries; i++)
+    {
+        powers[i] = GetNodePower(runs[i].begin, runs[i].length, runs[i + 1].length, length);
+        std::ptrdiff_t lastPopped = -1;
+
+        while (!path.empty() && powers[path.back()] > powers[i])
+        {
+            lastPopped = static_cast<std::ptrdiff_t>(path.back());
+            path.pop_back();
+        }
+
+        leftChild[i] = lastPopped;
+
+        if (!path.empty())
+        {
+            rightChild[path.back()] = static_cast<std::ptrdiff_t>(i);
+        }
+
+        path.push_back(i);
+    }
+
+    MergeRunTree(begin, runs, leftChild, rightChild, path.front(), 0, runs.size() - 1, pool, comp);
+}
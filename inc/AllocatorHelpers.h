@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+
+// Containers only take stateless allocators, so a fresh instance can be created
+// wherever a node has to be allocated or freed (e.g. a node releasing itself)
+
+template<typename T, typename Allocator, typename... Args>
+T* AllocateObject(Args&&... args)
+{
+    using ObjectAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+    using Traits = std::allocator_traits<ObjectAllocator>;
+
+    ObjectAllocator allocator;
+    T* ptr = Traits::allocate(allocator, 1);
+
+    try
+    {
+        Traits::construct(allocator, ptr, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        Traits::deallocate(allocator, ptr, 1);
+        throw;
+    }
+
+    return ptr;
+}
+
+template<typename Allocator, typename T>
+void DeallocateObject(T* ptr)
+{
+    using ObjectAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+    using Traits = std::allocator_traits<ObjectAllocator>;
+
+    ObjectAllocator allocator;
+    Traits::destroy(allocator, ptr);
+    Traits::deallocate(allocator, ptr, 1);
+}
+
+template<typename T, typename Allocator>
+struct AllocatorDeleter
+{
+    void operator()(T* ptr) const
+    {
+        DeallocateObject<Allocator>(ptr);
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <thread>
+#include <cstddef>
+
+// Reader-writer lock for read-mostly data (big-reader lock). Every thread is assigned
+// one of readerSlots reader counters, each on its own cache line, so readers of different
+// threads never write the same line. A writer raises the writer flag and waits until every
+// counter drains, so writes are expensive and should be rare.
+// Satisfies SharedMutex for lock/unlock and lock_shared/unlock_shared, unlock_shared
+// has to be called by the thread that called lock_shared
+class BigReaderMutex
+{
+public:
+    static constexpr std::size_t readerSlots = 32u;
+    static constexpr std::size_t cacheLineSize = 64u;
+
+    BigReaderMutex() = default;
+
+    void lock_shared()
+    {
+        std::atomic<std::size_t>& readers = GetReaderSlot().readers;
+
+        while (true)
+        {
+            // Pairs with the writer raising the flag, either the writer sees the counter
+            // or the reader sees the flag
+            readers.fetch_add(1, std::memory_order_seq_cst);
+
+            if (!writer.load(std::memory_order_seq_cst))
+            {
+                return;
+            }
+
+            readers.fetch_sub(1, std::memory_order_release);
+
+            while (writer.load(std::memory_order_relaxed))
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool try_lock_shared()
+    {
+        std::atomic<std::size_t>& readers = GetReaderSlot().readers;
+        readers.fetch_add(1, std::memory_order_seq_cst);
+
+        if (!writer.load(std::memory_order_seq_cst))
+        {
+            return true;
+        }
+
+        readers.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+
+    void unlock_shared()
+    {
+        GetReaderSlot().readers.fetch_sub(1, std::memory_order_release);
+    }
+
+    void lock()
+    {
+        writerMutex.lock();
+        writer.store(true, std::memory_order_seq_cst);
+
+        for (const auto& slot : slots)
+        {
+            while (slot.readers.load(std::memory_order_acquire) != 0)
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool try_lock()
+    {
+        if (!writerMutex.try_lock())
+        {
+            return false;
+        }
+
+        writer.store(true, std::memory_order_seq_cst);
+
+        for (const auto& slot : slots)
+        {
+            if (slot.readers.load(std::memory_order_acquire) != 0)
+            {
+                unlock();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void unlock()
+    {
+        writer.store(false, std::memory_order_release);
+        writerMutex.unlock();
+    }
+
+    BigReaderMutex(const BigReaderMutex&) = delete;
+    BigReaderMutex(BigReaderMutex&&) = delete;
+    BigReaderMutex& operator=(const BigReaderMutex&) = delete;
+    BigReaderMutex& operator=(BigReaderMutex&&) = delete;
+
+private:
+    struct alignas(cacheLineSize) ReaderSlot
+    {
+        std::atomic<std::size_t> readers = 0;
+    };
+
+    // Threads get slots round robin, so up to readerSlots threads never share a counter
+    static std::size_t GetThreadSlotIndex()
+    {
+        static std::atomic<std::size_t> nextIndex = 0;
+        thread_local std::size_t index = nextIndex.fetch_add(1, std::memory_order_relaxed) % readerSlots;
+
+        return index;
+    }
+
+    ReaderSlot& GetReaderSlot()
+    {
+        return slots[GetThreadSlotIndex()];
+    }
+
+    std::array<ReaderSlot, readerSlots> slots;
+    alignas(cacheLineSize) std::atomic<bool> writer = false;
+    std::mutex writerMutex;
+};
@@ -0,0 +1,447 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <tuple>
+
+#include "AllocatorHelpers.h"
+#include "OptimisticRead.h"
+
+// Chained hash table without any synchronization, used as a bucket layout of HashMap.
+// It grows by doubling when the load factor is exceeded, but entries are moved to the
+// new table incrementally: every modifying operation migrates a few old slots,
+// so no single call pays for the whole rehash
+template<typename Key, typename Value, typename Allocator = std::allocator<std::pair<Key, Value>>>
+class ChainedHashTable
+{
+public:
+    using element = std::pair<Key, Value>;
+
+    static constexpr bool optimisticReads = AllowOptimisticReads<Key, Value>::value;
+
+    static constexpr std::size_t initialSlots = 8u;
+    static constexpr std::size_t maxLoadFactor = 1u;
+    static constexpr std::size_t migrationStep = 4u;
+
+    ChainedHashTable() = default;
+
+    ~ChainedHashTable()
+    {
+        SlotArray* oldArray = oldSlots.load(std::memory_order_relaxed);
+        SlotArray* array = slots.load(std::memory_order_relaxed);
+
+        if (oldArray)
+        {
+            FreeEntries(*oldArray, migrated.load(std::memory_order_relaxed));
+            FreeSlotArray(oldArray);
+        }
+
+        if (array)
+        {
+            FreeEntries(*array, 0);
+            FreeSlotArray(array);
+        }
+
+        while (retiredSlots)
+        {
+            FreeSlotArray(std::exchange(retiredSlots, retiredSlots->nextRetired));
+        }
+
+        while (freeEntries)
+        {
+            DeallocateObject<Allocator>(std::exchange(freeEntries, freeEntries->next.load(std::memory_order_relaxed)));
+        }
+    }
+
+    template<typename K>
+    const Value* Find(const K& key, std::size_t hash) const
+    {
+        if (!slots.load(std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+
+        const Entry* entry = GetChain(hash).load(std::memory_order_relaxed);
+
+        while (entry && !IsMatching(entry, key, hash))
+        {
+            entry = entry->next.load(std::memory_order_relaxed);
+        }
+
+        return entry ? &entry->value.second : nullptr;
+    }
+
+    template<typename K>
+    Value* Find(const K& key, std::size_t hash)
+    {
+        return const_cast<Value*>(std::as_const(*this).Find(key, hash));
+    }
+
+    // Can run concurrently with a writer, the result is only meaningful if the writer
+    // didn't run, which is checked by the caller. Chains can be torn by a concurrent
+    // migration, so the walk is bounded by the amount of entries
+    template<typename K>
+    OptimisticReadResult FindOptimistic(const K& key, std::size_t hash, Value& value) const
+    {
+        static_assert(optimisticReads, "Optimistic reads require trivially copyable keys and values");
+
+        const SlotArray* array = slots.load(std::memory_order_acquire);
+
+        if (!array)
+        {
+            return OptimisticReadResult::Absent;
+        }
+
+        const std::atomic<Entry*>* chain = &array->slots[hash & (array->size - 1)];
+
+        if (const SlotArray* oldArray = oldSlots.load(std::memory_order_acquire))
+        {
+            std::size_t oldIndex = hash & (oldArray->size - 1);
+
+            if (oldIndex >= migrated.load(std::memory_order_acquire))
+            {
+                chain = &oldArray->slots[oldIndex];
+            }
+        }
+
+        std::size_t stepsLeft = count.load(std::memory_order_acquire) + 1;
+
+        for (const Entry* entry = chain->load(std::memory_order_acquire); entry;
+            entry = entry->next.load(std::memory_order_acquire))
+        {
+            if (stepsLeft-- == 0)
+            {
+                return OptimisticReadResult::Retry;
+            }
+
+            if (OptimisticLoad(entry->hash) == hash && OptimisticLoad(entry->value.first) == key)
+            {
+                value = OptimisticLoad(entry->value.second);
+                return OptimisticReadResult::Found;
+            }
+        }
+
+        return OptimisticReadResult::Absent;
+    }
+
+    // Hint for batched lookups, starts loading the chain head of the key.
+    // Like FindOptimistic it can run concurrently with a writer
+    void Prefetch(std::size_t hash) const
+    {
+        if (const SlotArray* array = slots.load(std::memory_order_acquire))
+        {
+            PrefetchAddress(&array->slots[hash & (array->size - 1)]);
+        }
+    }
+
+    // Constructs the value from args only if the key is absent, returns the stored value
+    // and whether it was inserted
+    template<typename K, typename... Args>
+    std::pair<Value*, bool> TryEmplace(const K& key, std::size_t hash, Args&&... args)
+    {
+        if (!slots.load(std::memory_order_relaxed))
+        {
+            slots.store(CreateSlotArray(initialSlots), std::memory_order_release);
+        }
+
+        MigrateSlots();
+
+        std::atomic<Entry*>* link = FindLink(key, hash);
+
+        if (Entry* entry = link->load(std::memory_order_relaxed))
+        {
+            return { &entry->value.second, false };
+        }
+
+        Entry* entry = CreateEntry(hash, std::piecewise_construct,
+            std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        link->store(entry, std::memory_order_release);
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+        GrowIfNeeded();
+
+        return { &entry->value.second, true };
+    }
+
+    template<typename K>
+    bool Erase(const K& key, std::size_t hash)
+    {
+        if (!slots.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        MigrateSlots();
+
+        std::atomic<Entry*>* link = FindLink(key, hash);
+        Entry* entry = link->load(std::memory_order_relaxed);
+
+        if (!entry)
+        {
+            return false;
+        }
+
+        link->store(entry->next.load(std::memory_order_relaxed), std::memory_order_release);
+        DestroyEntry(entry);
+        count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+
+        return true;
+    }
+
+    std::size_t Size() const
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    template<typename Func>
+    void ForEach(Func&& func) const
+    {
+        auto visitSlots = [&func](const SlotArray* array, std::size_t first)
+        {
+            if (!array)
+            {
+                return;
+            }
+
+            for (std::size_t i = first; i < array->size; i++)
+            {
+                for (const Entry* entry = array->slots[i].load(std::memory_order_relaxed); entry;
+                    entry = entry->next.load(std::memory_order_relaxed))
+                {
+                    func(entry->value);
+                }
+            }
+        };
+
+        visitSlots(oldSlots.load(std::memory_order_relaxed), migrated.load(std::memory_order_relaxed));
+        visitSlots(slots.load(std::memory_order_relaxed), 0);
+    }
+
+    ChainedHashTable(const ChainedHashTable&) = delete;
+    ChainedHashTable(ChainedHashTable&&) = delete;
+    ChainedHashTable& operator=(const ChainedHashTable&) = delete;
+    ChainedHashTable& operator=(ChainedHashTable&&) = delete;
+
+private:
+    struct Entry
+    {
+        template<typename... Args>
+        explicit Entry(std::size_t hash, Args&&... args) :
+            hash(hash), value(std::forward<Args>(args)...)
+        { }
+
+        std::size_t hash;
+        element value;
+        std::atomic<Entry*> next = nullptr;
+    };
+
+    // Size and pointer never change after creation, so optimistic readers get
+    // a consistent pair by loading a single pointer
+    struct SlotArray
+    {
+        std::size_t size;
+        std::atomic<Entry*>* slots;
+        SlotArray* nextRetired = nullptr;
+    };
+
+    using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::atomic<Entry*>>;
+
+    static SlotArray* CreateSlotArray(std::size_t size)
+    {
+        SlotAllocator allocator;
+        std::atomic<Entry*>* array = std::allocator_traits<SlotAllocator>::allocate(allocator, size);
+
+        for (std::size_t i = 0; i < size; i++)
+        {
+            new (&array[i]) std::atomic<Entry*>(nullptr);
+        }
+
+        return AllocateObject<SlotArray, Allocator>(SlotArray{ size, array });
+    }
+
+    static void FreeSlotArray(SlotArray* array)
+    {
+        SlotAllocator allocator;
+        std::allocator_traits<SlotAllocator>::deallocate(allocator, array->slots, array->size);
+        DeallocateObject<Allocator>(array);
+    }
+
+    static void FreeEntries(SlotArray& array, std::size_t first)
+    {
+        for (std::size_t i = first; i < array.size; i++)
+        {
+            Entry* entry = array.slots[i].load(std::memory_order_relaxed);
+
+            while (entry)
+            {
+                DeallocateObject<Allocator>(std::exchange(entry, entry->next.load(std::memory_order_relaxed)));
+            }
+        }
+    }
+
+    // With optimistic reads erased entries are kept for reuse, so a reader
+    // never touches freed memory. A reader may still be walking a reused entry,
+    // so its fields are overwritten with atomic stores
+    template<typename... Args>
+    Entry* CreateEntry(std::size_t hash, Args&&... args)
+    {
+        if constexpr (optimisticReads)
+        {
+            if (freeEntries)
+            {
+                Entry* entry = freeEntries;
+                freeEntries = entry->next.load(std::memory_order_relaxed);
+
+                OptimisticStore(entry->hash, hash);
+                OptimisticStore(entry->value, element(std::forward<Args>(args)...));
+                entry->next.store(nullptr, std::memory_order_release);
+
+                return entry;
+            }
+        }
+
+        return AllocateObject<Entry, Allocator>(hash, std::forward<Args>(args)...);
+    }
+
+    void DestroyEntry(Entry* entry)
+    {
+        if constexpr (optimisticReads)
+        {
+            entry->next.store(freeEntries, std::memory_order_release);
+            freeEntries = entry;
+            return;
+        }
+
+        DeallocateObject<Allocator>(entry);
+    }
+
+    void RetireSlotArray(SlotArray* array)
+    {
+        if constexpr (optimisticReads)
+        {
+            array->nextRetired = retiredSlots;
+            retiredSlots = array;
+            return;
+        }
+
+        FreeSlotArray(array);
+    }
+
+    static void PrefetchAddress(const void* address)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#else
+        (void)address;
+#endif
+    }
+
+    template<typename K>
+    static bool IsMatching(const Entry* entry, const K& key, std::size_t hash)
+    {
+        return entry->hash == hash && entry->value.first == key;
+    }
+
+    // Returns the link pointing to the element or the terminating link of its chain,
+    // slots have to be allocated
+    template<typename K>
+    std::atomic<Entry*>* FindLink(const K& key, std::size_t hash)
+    {
+        std::atomic<Entry*>* link = &GetChain(hash);
+        Entry* entry = nullptr;
+
+        while ((entry = link->load(std::memory_order_relaxed)) && !IsMatching(entry, key, hash))
+        {
+            link = &entry->next;
+        }
+
+        return link;
+    }
+
+    // Old slots below migrated have already been moved to the new table
+    std::atomic<Entry*>& GetChain(std::size_t hash) const
+    {
+        if (SlotArray* oldArray = oldSlots.load(std::memory_order_relaxed))
+        {
+            std::size_t oldIndex = hash & (oldArray->size - 1);
+
+            if (oldIndex >= migrated.load(std::memory_order_relaxed))
+            {
+                return oldArray->slots[oldIndex];
+            }
+        }
+
+        SlotArray* array = slots.load(std::memory_order_relaxed);
+        return array->slots[hash & (array->size - 1)];
+    }
+
+    void GrowIfNeeded()
+    {
+        SlotArray* array = slots.load(std::memory_order_relaxed);
+
+        if (count.load(std::memory_order_relaxed) <= array->size * maxLoadFactor)
+        {
+            return;
+        }
+
+        // Migration moves at least one slot per modification, so it's normally finished
+        // long before the next growth, but finish it anyway to only ever have two tables
+        while (oldSlots.load(std::memory_order_relaxed))
+        {
+            MigrateSlots();
+        }
+
+        migrated.store(0, std::memory_order_release);
+        oldSlots.store(array, std::memory_order_release);
+        slots.store(CreateSlotArray(array->size * 2), std::memory_order_release);
+    }
+
+    void MigrateSlots()
+    {
+        SlotArray* oldArray = oldSlots.load(std::memory_order_relaxed);
+
+        if (!oldArray)
+        {
+            return;
+        }
+
+        SlotArray* array = slots.load(std::memory_order_relaxed);
+        std::size_t mask = array->size - 1;
+        std::size_t index = migrated.load(std::memory_order_relaxed);
+        std::size_t last = std::min(index + migrationStep, oldArray->size);
+
+        for (; index < last; index++)
+        {
+            Entry* entry = oldArray->slots[index].load(std::memory_order_relaxed);
+
+            while (entry)
+            {
+                Entry* next = entry->next.load(std::memory_order_relaxed);
+                std::atomic<Entry*>& chain = array->slots[entry->hash & mask];
+                entry->next.store(chain.load(std::memory_order_relaxed), std::memory_order_release);
+                chain.store(entry, std::memory_order_release);
+                entry = next;
+            }
+
+            oldArray->slots[index].store(nullptr, std::memory_order_release);
+            migrated.store(index + 1, std::memory_order_release);
+        }
+
+        if (index == oldArray->size)
+        {
+            oldSlots.store(nullptr, std::memory_order_release);
+            migrated.store(0, std::memory_order_release);
+            RetireSlotArray(oldArray);
+        }
+    }
+
+    std::atomic<SlotArray*> slots = nullptr;
+    std::atomic<SlotArray*> oldSlots = nullptr;
+    std::atomic<std::size_t> migrated = 0;
+    std::atomic<std::size_t> count = 0;
+
+    Entry* freeEntries = nullptr;
+    SlotArray* retiredSlots = nullptr;
+};
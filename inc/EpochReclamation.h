@@ -0,0 +1,277 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <utility>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Epoch based memory reclamation for lock-free containers. Threads pin the current epoch
+// with a Guard while they hold pointers into a container, retired objects are freed once
+// the global epoch has advanced twice since retirement, at which point no guard can still
+// see them. The epoch advances only when every pinned thread has observed it
+class EpochReclamation
+{
+public:
+    using Deleter = void (*)(void*);
+
+    static constexpr std::size_t retiresPerAdvance = 64u;
+
+    // Reentrant, only the outermost guard of a thread pins and unpins the epoch
+    class Guard
+    {
+    public:
+        Guard()
+        {
+            GetThreadHandle().Enter();
+        }
+
+        Guard(const Guard&) :
+            Guard()
+        { }
+
+        Guard& operator=(const Guard&)
+        {
+            return *this;
+        }
+
+        ~Guard()
+        {
+            GetThreadHandle().Leave();
+        }
+    };
+
+    // The object has to be unreachable for threads that enter a guard after this call
+    static void Retire(void* ptr, Deleter deleter)
+    {
+        GetThreadHandle().Retire(ptr, deleter);
+    }
+
+    ~EpochReclamation()
+    {
+        for (auto& retired : orphans)
+        {
+            retired.deleter(retired.ptr);
+        }
+
+        ThreadRecord* record = records.load(std::memory_order_relaxed);
+
+        while (record)
+        {
+            delete std::exchange(record, record->next);
+        }
+    }
+
+    EpochReclamation(const EpochReclamation&) = delete;
+    EpochReclamation(EpochReclamation&&) = delete;
+    EpochReclamation& operator=(const EpochReclamation&) = delete;
+    EpochReclamation& operator=(EpochReclamation&&) = delete;
+
+private:
+    struct Retired
+    {
+        void* ptr;
+        Deleter deleter;
+        std::uint64_t epoch;
+    };
+
+    // Lowest bit is set while the thread is pinned, the rest is the pinned epoch
+    struct alignas(64) ThreadRecord
+    {
+        std::atomic<std::uint64_t> state = 0;
+        std::atomic<bool> inUse = true;
+        ThreadRecord* next = nullptr;
+    };
+
+    class ThreadHandle
+    {
+    public:
+        explicit ThreadHandle(EpochReclamation& domain) :
+            domain(domain),
+            record(domain.AcquireRecord())
+        { }
+
+        ~ThreadHandle()
+        {
+            domain.AddOrphans(bags);
+            record->inUse.store(false, std::memory_order_release);
+        }
+
+        void Enter()
+        {
+            if (nesting++ == 0)
+            {
+                std::uint64_t epoch = domain.globalEpoch.load(std::memory_order_acquire);
+
+                // Announcing the epoch has to be visible before any shared pointer is read. A read-modify-write
+                // is a full barrier like a store followed by a fence, and unlike fences TSAN understands it
+                record->state.exchange((epoch << 1) | 1u, std::memory_order_seq_cst);
+            }
+        }
+
+        void Leave()
+        {
+            if (--nesting == 0)
+            {
+                record->state.store(0, std::memory_order_release);
+            }
+        }
+
+        void Retire(void* ptr, Deleter deleter)
+        {
+            std::uint64_t epoch = domain.globalEpoch.load(std::memory_order_acquire);
+            std::vector<Retired>& bag = bags[epoch % bags.size()];
+
+            // Bags are reused round robin, a bag of an older epoch is at least three epochs old
+            if (!bag.empty() && bag.front().epoch != epoch)
+            {
+                FreeBag(bag);
+            }
+
+            bag.push_back({ ptr, deleter, epoch });
+
+            if (++retiredSinceAdvance >= retiresPerAdvance)
+            {
+                retiredSinceAdvance = 0;
+                std::uint64_t current = domain.TryAdvance();
+
+                for (auto& candidate : bags)
+                {
+                    if (!candidate.empty() && candidate.front().epoch + 2 <= current)
+                    {
+                        FreeBag(candidate);
+                    }
+                }
+            }
+        }
+
+        ThreadHandle(const ThreadHandle&) = delete;
+        ThreadHandle(ThreadHandle&&) = delete;
+        ThreadHandle& operator=(const ThreadHandle&) = delete;
+        ThreadHandle& operator=(ThreadHandle&&) = delete;
+
+    private:
+        static void FreeBag(std::vector<Retired>& bag)
+        {
+            for (auto& retired : bag)
+            {
+                retired.deleter(retired.ptr);
+            }
+
+            bag.clear();
+        }
+
+        EpochReclamation& domain;
+        ThreadRecord* record;
+        std::size_t nesting = 0;
+        std::size_t retiredSinceAdvance = 0;
+        std::array<std::vector<Retired>, 3> bags;
+    };
+
+    EpochReclamation() = default;
+
+    static EpochReclamation& GetInstance()
+    {
+        static EpochReclamation domain;
+        return domain;
+    }
+
+    // Thread local objects of a thread are destroyed before the static domain,
+    // so leftovers of the thread can always be handed over
+    static ThreadHandle& GetThreadHandle()
+    {
+        thread_local ThreadHandle handle(GetInstance());
+        return handle;
+    }
+
+    // Records of finished threads are reused, the list only ever grows
+    ThreadRecord* AcquireRecord()
+    {
+        for (ThreadRecord* record = records.load(std::memory_order_acquire); record; record = record->next)
+        {
+            bool inUse = false;
+
+            if (!record->inUse.load(std::memory_order_relaxed) &&
+                record->inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+            {
+                return record;
+            }
+        }
+
+        auto* record = new ThreadRecord();
+        record->next = records.load(std::memory_order_relaxed);
+
+        while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+        { }
+
+        return record;
+    }
+
+    // Returns the global epoch after the attempt
+    std::uint64_t TryAdvance()
+    {
+        // Read-modify-write for the same reason as in Enter, the retired objects have to be unlinked
+        // before any pinned epoch is read
+        std::uint64_t epoch = globalEpoch.fetch_add(0, std::memory_order_seq_cst);
+
+        for (ThreadRecord* record = records.load(std::memory_order_acquire); record; record = record->next)
+        {
+            std::uint64_t state = record->state.load(std::memory_order_acquire);
+
+            if ((state & 1u) && (state >> 1) != epoch)
+            {
+                return epoch;
+            }
+        }
+
+        if (globalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            epoch++;
+        }
+
+        FreeOrphans(epoch);
+
+        return epoch;
+    }
+
+    void AddOrphans(std::array<std::vector<Retired>, 3>& bags)
+    {
+        std::scoped_lock lock(orphansMutex);
+
+        for (auto& bag : bags)
+        {
+            orphans.insert(orphans.end(), bag.begin(), bag.end());
+        }
+    }
+
+    void FreeOrphans(std::uint64_t epoch)
+    {
+        std::unique_lock lock(orphansMutex, std::try_to_lock);
+
+        if (!lock.owns_lock())
+        {
+            return;
+        }
+
+        auto last = std::partition(orphans.begin(), orphans.end(), [epoch](const Retired& retired)
+        {
+            return retired.epoch + 2 > epoch;
+        });
+
+        for (auto it = last; it != orphans.end(); ++it)
+        {
+            it->deleter(it->ptr);
+        }
+
+        orphans.erase(last, orphans.end());
+    }
+
+    std::atomic<std::uint64_t> globalEpoch = 0;
+    std::atomic<ThreadRecord*> records = nullptr;
+
+    std::mutex orphansMutex;
+    std::vector<Retired> orphans;
+};
@@ -0,0 +1,506 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "MergeSort.h"
+
+struct ExternalSortOptions
+{
+    // Bound for all record buffers. Run generation keeps three chunks of a third of it:
+    // the one being sorted, its sort buffer and the previous run being written
+    std::size_t memoryBytes = std::size_t(256) << 20;
+    // Size of every read and write of the merge, every run and the output get two of them
+    std::size_t ioBufferBytes = std::size_t(4) << 20;
+    std::filesystem::path tempDirectory = std::filesystem::temp_directory_path();
+};
+
+struct ExternalSortStatistics
+{
+    std::uint64_t records = 0;
+    std::size_t runs = 0;
+    std::size_t mergePasses = 0;
+};
+
+namespace External
+{
+    struct FileCloser
+    {
+        void operator()(std::FILE* file) const
+        {
+            std::fclose(file);
+        }
+    };
+
+    using FileHandle = std::unique_ptr<std::FILE, FileCloser>;
+
+    inline FileHandle OpenFile(const std::filesystem::path& path, const char* mode)
+    {
+        FileHandle file(std::fopen(path.string().c_str(), mode));
+
+        if (!file)
+        {
+            throw std::runtime_error("Can't open " + path.string());
+        }
+
+        // Reads and writes are already large, stdio buffering would only add a copy
+        std::setvbuf(file.get(), nullptr, _IONBF, 0);
+
+        return file;
+    }
+
+    template<typename Record>
+    std::size_t ReadRecords(std::FILE* file, Record* records, std::size_t count)
+    {
+        std::size_t read = std::fread(records, sizeof(Record), count, file);
+
+        if (read < count && std::ferror(file))
+        {
+            throw std::runtime_error("Reading records failed");
+        }
+
+        return read;
+    }
+
+    template<typename Record>
+    void WriteRecords(std::FILE* file, const Record* records, std::size_t count)
+    {
+        if (std::fwrite(records, sizeof(Record), count, file) != count)
+        {
+            throw std::runtime_error("Writing records failed");
+        }
+    }
+
+    // Removes the file when destroyed
+    class TempFile
+    {
+    public:
+        explicit TempFile(std::filesystem::path path) :
+            path(std::move(path))
+        { }
+
+        TempFile(TempFile&& other) noexcept :
+            path(std::exchange(other.path, {}))
+        { }
+
+        ~TempFile()
+        {
+            if (!path.empty())
+            {
+                std::error_code error;
+                std::filesystem::remove(path, error);
+            }
+        }
+
+        const std::filesystem::path& GetPath() const
+        {
+            return path;
+        }
+
+        TempFile(const TempFile&) = delete;
+        TempFile& operator=(const TempFile&) = delete;
+        TempFile& operator=(TempFile&&) = delete;
+
+    private:
+        std::filesystem::path path;
+    };
+
+    // Sequential reader of a run, the next buffer is read on the pool while the current
+    // one is consumed
+    template<typename Record, typename ThreadPool>
+    class RunReader
+    {
+    public:
+        RunReader(const std::filesystem::path& path, std::size_t bufferRecords, ThreadPool& pool) :
+            file(OpenFile(path, "rb")),
+            pool(pool),
+            current(bufferRecords),
+            next(bufferRecords)
+        {
+            StartRead();
+            Advance();
+        }
+
+        ~RunReader()
+        {
+            if (pending.valid())
+            {
+                pool.WaitFor(pending);
+            }
+        }
+
+        bool IsEmpty() const
+        {
+            return position == size;
+        }
+
+        const Record& Front() const
+        {
+            return current[position];
+        }
+
+        void Pop()
+        {
+            if (++position == size)
+            {
+                Advance();
+            }
+        }
+
+        RunReader(const RunReader&) = delete;
+        RunReader(RunReader&&) = delete;
+        RunReader& operator=(const RunReader&) = delete;
+        RunReader& operator=(RunReader&&) = delete;
+
+    private:
+        void StartRead()
+        {
+            pending = pool.Enqueue([this]()
+            {
+                return ReadRecords(file.get(), next.data(), next.size());
+            });
+        }
+
+        void Advance()
+        {
+            pool.WaitFor(pending);
+            size = pending.get();
+            position = 0;
+
+            if (size != 0)
+            {
+                std::swap(current, next);
+                StartRead();
+            }
+        }
+
+        FileHandle file;
+        ThreadPool& pool;
+        std::vector<Record> current;
+        std::vector<Record> next;
+        std::size_t position = 0;
+        std::size_t size = 0;
+        std::future<std::size_t> pending;
+    };
+
+    // Sequential writer, a full buffer is written on the pool while the next one is filled
+    template<typename Record, typename ThreadPool>
+    class RunWriter
+    {
+    public:
+        RunWriter(const std::filesystem::path& path, std::size_t bufferRecords, ThreadPool& pool) :
+            file(OpenFile(path, "wb")),
+            pool(pool),
+            capacity(bufferRecords)
+        {
+            current.reserve(capacity);
+            writing.reserve(capacity);
+        }
+
+        ~RunWriter()
+        {
+            if (pending.valid())
+            {
+                pool.WaitFor(pending);
+            }
+        }
+
+        void Push(const Record& record)
+        {
+            current.push_back(record);
+
+            if (current.size() == capacity)
+            {
+                Flush();
+            }
+        }
+
+        void Finish()
+        {
+            Flush();
+            Wait();
+
+            if (std::fclose(file.release()) != 0)
+            {
+                throw std::runtime_error("Closing a run failed");
+            }
+        }
+
+        RunWriter(const RunWriter&) = delete;
+        RunWriter(RunWriter&&) = delete;
+        RunWriter& operator=(const RunWriter&) = delete;
+        RunWriter& operator=(RunWriter&&) = delete;
+
+    private:
+        void Wait()
+        {
+            if (pending.valid())
+            {
+                pool.WaitFor(pending);
+                pending.get();
+            }
+        }
+
+        void Flush()
+        {
+            Wait();
+            std::swap(current, writing);
+            current.clear();
+
+            pending = pool.Enqueue([this]()
+            {
+                WriteRecords(file.get(), writing.data(), writing.size());
+            });
+        }
+
+        FileHandle file;
+        ThreadPool& pool;
+        std::size_t capacity;
+        std::vector<Record> current;
+        std::vector<Record> writing;
+        std::future<void> pending;
+    };
+
+    // Tournament tree over k > 0 sources with the loser of every match kept in its inner node,
+    // replacing the winner replays only its path to the root: log k comparisons per record.
+    // Exhausted sources lose every match, ties go to the lower source for a stable merge
+    template<typename Source, typename Comp>
+    class LoserTree
+    {
+    public:
+        LoserTree(std::vector<Source*> sources, Comp comp) :
+            sources(std::move(sources)),
+            tree(this->sources.size()),
+            comp(comp)
+        {
+            tree[0] = Build(1);
+        }
+
+        bool IsEmpty() const
+        {
+            return sources[tree[0]]->IsEmpty();
+        }
+
+        Source& Top()
+        {
+            return *sources[tree[0]];
+        }
+
+        // Has to be called after the top source was popped
+        void Replay()
+        {
+            std::size_t winner = tree[0];
+
+            for (std::size_t node = (winner + sources.size()) / 2; node > 0; node /= 2)
+            {
+                if (Less(tree[node], winner))
+                {
+                    std::swap(tree[node], winner);
+                }
+            }
+
+            tree[0] = winner;
+        }
+
+        LoserTree(const LoserTree&) = delete;
+        LoserTree(LoserTree&&) = delete;
+        LoserTree& operator=(const LoserTree&) = delete;
+        LoserTree& operator=(LoserTree&&) = delete;
+
+    private:
+        // Leaves are nodes k to 2k - 1, returns the winner of the subtree
+        std::size_t Build(std::size_t node)
+        {
+            if (node >= sources.size())
+            {
+                return node - sources.size();
+            }
+
+            std::size_t left = Build(2 * node);
+            std::size_t right = Build(2 * node + 1);
+
+            if (Less(right, left))
+            {
+                tree[node] = left;
+                return right;
+            }
+
+            tree[node] = right;
+            return left;
+        }
+
+        bool Less(std::size_t left, std::size_t right) const
+        {
+            if (sources[left]->IsEmpty() || sources[right]->IsEmpty())
+            {
+                return !sources[left]->IsEmpty();
+            }
+
+            const auto& leftRecord = sources[left]->Front();
+            const auto& rightRecord = sources[right]->Front();
+
+            return comp(leftRecord, rightRecord) || (!comp(rightRecord, leftRecord) && left < right);
+        }
+
+        std::vector<Source*> sources;
+        std::vector<std::size_t> tree;
+        Comp comp;
+    };
+
+    template<typename Record, typename ThreadPool, typename Comp>
+    std::uint64_t MergeRuns(const std::vector<TempFile>& runs, std::size_t first, std::size_t last,
+        const std::filesystem::path& output, std::size_t bufferRecords, ThreadPool& pool, Comp& comp)
+    {
+        using Reader = RunReader<Record, ThreadPool>;
+
+        std::vector<std::unique_ptr<Reader>> readers;
+        std::vector<Reader*> sources;
+
+        for (std::size_t run = first; run < last; run++)
+        {
+            readers.push_back(std::make_unique<Reader>(runs[run].GetPath(), bufferRecords, pool));
+            sources.push_back(readers.back().get());
+        }
+
+        RunWriter<Record, ThreadPool> writer(output, bufferRecords, pool);
+        std::uint64_t records = 0;
+
+        if (!sources.empty())
+        {
+            LoserTree<Reader, Comp&> tree(std::move(sources), comp);
+
+            while (!tree.IsEmpty())
+            {
+                writer.Push(tree.Top().Front());
+                tree.Top().Pop();
+                tree.Replay();
+                records++;
+            }
+        }
+
+        writer.Finish();
+
+        return records;
+    }
+
+    inline std::filesystem::path GetTempPrefix(const std::filesystem::path& directory)
+    {
+        static std::atomic<std::uint64_t> counter = 0;
+        std::random_device device;
+
+        return directory / ("external-sort-" + std::to_string(device()) + "-" + std::to_string(counter++));
+    }
+}
+
+// Sorts a file of fixed size records that may not fit into memory. Chunks of the input are
+// sorted with the thread pool merge sort and written as runs, each while the next chunk is
+// read and sorted. Runs are then merged by loser trees of bounded fan-in over double
+// buffered readers, so reading the next buffers overlaps merging the current ones.
+// Temporary runs are created in options.tempDirectory and removed even on failure
+template<typename Record, typename ThreadPool, typename Comp = std::less<>>
+ExternalSortStatistics ExternalSort(const std::filesystem::path& input, const std::filesystem::path& output,
+    ThreadPool& pool, Comp comp = {}, const ExternalSortOptions& options = {})
+{
+    static_assert(std::is_trivially_copyable_v<Record>, "Records are stored as raw bytes");
+
+    if (std::filesystem::file_size(input) % sizeof(Record) != 0)
+    {
+        throw std::invalid_argument("The input isn't a whole number of records");
+    }
+
+    std::size_t chunkRecords = std::max<std::size_t>(options.memoryBytes / (3 * sizeof(Record)), 1u);
+    std::size_t bufferRecords = std::max<std::size_t>(options.ioBufferBytes / sizeof(Record), 1u);
+    std::size_t buffers = options.memoryBytes / std::max<std::size_t>(options.ioBufferBytes, 1u);
+    std::size_t fanIn = std::max<std::size_t>(buffers / 2, 3u) - 1;
+
+    std::filesystem::path prefix = External::GetTempPrefix(options.tempDirectory);
+    ExternalSortStatistics statistics;
+    std::vector<External::TempFile> runs;
+
+    {
+        External::FileHandle file = External::OpenFile(input, "rb");
+        std::vector<Record> chunk(chunkRecords);
+        std::vector<Record> writing;
+        std::future<void> pendingWrite;
+
+        auto waitForWrite = [&pool, &pendingWrite]()
+        {
+            if (pendingWrite.valid())
+            {
+                pool.WaitFor(pendingWrite);
+                pendingWrite.get();
+            }
+        };
+
+        try
+        {
+            while (std::size_t count = External::ReadRecords(file.get(), chunk.data(), chunkRecords))
+            {
+                ParallelMergeSortThreadPool(chunk.begin(), chunk.begin() + count, pool, comp);
+                statistics.records += count;
+
+                waitForWrite();
+                std::swap(chunk, writing);
+                chunk.resize(chunkRecords);
+
+                runs.emplace_back(prefix.string() + "-run" + std::to_string(runs.size()));
+                pendingWrite = pool.Enqueue([&writing, count, path = runs.back().GetPath()]()
+                {
+                    External::FileHandle run = External::OpenFile(path, "wb");
+                    External::WriteRecords(run.get(), writing.data(), count);
+
+                    if (std::fclose(run.release()) != 0)
+                    {
+                        throw std::runtime_error("Closing a run failed");
+                    }
+                });
+            }
+
+            waitForWrite();
+        }
+        catch (...)
+        {
+            if (pendingWrite.valid())
+            {
+                pool.WaitFor(pendingWrite);
+            }
+
+            throw;
+        }
+    }
+
+    statistics.runs = runs.size();
+
+    while (runs.size() > fanIn)
+    {
+        std::vector<External::TempFile> merged;
+
+        for (std::size_t first = 0; first < runs.size(); first += fanIn)
+        {
+            merged.emplace_back(prefix.string() + "-pass" + std::to_string(statistics.mergePasses) +
+                "-run" + std::to_string(merged.size()));
+
+            External::MergeRuns<Record>(runs, first, std::min(first + fanIn, runs.size()),
+                merged.back().GetPath(), bufferRecords, pool, comp);
+        }
+
+        runs = std::move(merged);
+        statistics.mergePasses++;
+    }
+
+    External::MergeRuns<Record>(runs, 0, runs.size(), output, bufferRecords, pool, comp);
+    statistics.mergePasses++;
+
+    return statistics;
+}
@@ -0,0 +1,689 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <tuple>
+#include <atomic>
+#include <vector>
+#include <initializer_list>
+
+#include "AllocatorHelpers.h"
+#include "OptimisticRead.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLAT_HASH_TABLE_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Open addressing hash table without any synchronization, used as a bucket layout of HashMap.
+// Slots are split into groups of 16 with one control byte per slot holding 7 bits of the hash,
+// so a whole group is probed with a couple of SIMD instructions and keys are compared only
+// for matching tags. Like ChainedHashTable it grows by migrating a few groups per modification
+template<typename Key, typename Value, typename Allocator = std::allocator<std::pair<Key, Value>>>
+class FlatHashTable
+{
+public:
+    using element = std::pair<Key, Value>;
+
+    static constexpr std::size_t groupSize = 16u;
+    static constexpr std::size_t initialCapacity = 16u;
+    static constexpr std::size_t migrationStep = 2u;
+
+    static constexpr bool optimisticReads = AllowOptimisticReads<Key, Value>::value;
+
+    FlatHashTable() = default;
+
+    ~FlatHashTable()
+    {
+        DestroyTable(current.load(std::memory_order_relaxed));
+        DestroyTable(old.load(std::memory_order_relaxed));
+
+        while (retiredTables)
+        {
+            DestroyTable(std::exchange(retiredTables, retiredTables->nextRetired));
+        }
+    }
+
+    template<typename K>
+    const Value* Find(const K& key, std::size_t hash) const
+    {
+        return FindMixed(key, Mix(hash));
+    }
+
+    template<typename K>
+    Value* Find(const K& key, std::size_t hash)
+    {
+        return const_cast<Value*>(std::as_const(*this).Find(key, hash));
+    }
+
+    // Can run concurrently with a writer, the result is only meaningful if the writer
+    // didn't run, which is checked by the caller
+    template<typename K>
+    OptimisticReadResult FindOptimistic(const K& key, std::size_t hash, Value& value) const
+    {
+        static_assert(optimisticReads, "Optimistic reads require trivially copyable keys and values");
+
+        hash = Mix(hash);
+
+        for (const Table* table : { current.load(std::memory_order_acquire), old.load(std::memory_order_acquire) })
+        {
+            if (!table)
+            {
+                continue;
+            }
+
+            OptimisticReadResult result = table->FindOptimistic(key, hash, value);
+
+            if (result != OptimisticReadResult::Absent)
+            {
+                return result;
+            }
+        }
+
+        return OptimisticReadResult::Absent;
+    }
+
+    // Hint for batched lookups, starts loading the control bytes and slots of the first probed group.
+    // Like FindOptimistic it can run concurrently with a writer
+    void Prefetch(std::size_t hash) const
+    {
+        if (const Table* table = current.load(std::memory_order_acquire))
+        {
+            hash = Mix(hash);
+            std::size_t base = (GetGroup(hash) & (table->capacity / groupSize - 1)) * groupSize;
+
+            PrefetchAddress(table->control + base);
+            PrefetchAddress(table->slots + base);
+        }
+    }
+
+    // Constructs the value from args only if the key is absent, returns the stored value
+    // and whether it was inserted
+    template<typename K, typename... Args>
+    std::pair<Value*, bool> TryEmplace(const K& key, std::size_t hash, Args&&... args)
+    {
+        hash = Mix(hash);
+
+        MigrateGroups();
+
+        if (Value* found = FindMixed(key, hash))
+        {
+            return { found, false };
+        }
+
+        GrowIfNeeded();
+
+        element* inserted = current.load(std::memory_order_relaxed)->Insert(hash, std::piecewise_construct,
+            std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+
+        return { &inserted->second, true };
+    }
+
+    template<typename K>
+    bool Erase(const K& key, std::size_t hash)
+    {
+        hash = Mix(hash);
+
+        MigrateGroups();
+
+        Table* currentTable = current.load(std::memory_order_relaxed);
+        Table* oldTable = old.load(std::memory_order_relaxed);
+
+        return (currentTable && currentTable->Erase(key, hash)) || (oldTable && oldTable->Erase(key, hash));
+    }
+
+    std::size_t Size() const
+    {
+        const Table* currentTable = current.load(std::memory_order_relaxed);
+        const Table* oldTable = old.load(std::memory_order_relaxed);
+
+        return (currentTable ? currentTable->size : 0) + (oldTable ? oldTable->size : 0);
+    }
+
+    template<typename Func>
+    void ForEach(Func&& func) const
+    {
+        for (const Table* table : { old.load(std::memory_order_relaxed), current.load(std::memory_order_relaxed) })
+        {
+            if (table)
+            {
+                table->ForEach(func);
+            }
+        }
+    }
+
+    FlatHashTable(const FlatHashTable&) = delete;
+    FlatHashTable(FlatHashTable&&) = delete;
+    FlatHashTable& operator=(const FlatHashTable&) = delete;
+    FlatHashTable& operator=(FlatHashTable&&) = delete;
+
+private:
+    static constexpr std::int8_t emptyTag = -128;
+    static constexpr std::int8_t deletedTag = -2;
+
+    using BitMask = std::uint32_t;
+
+    // Copy of the control bytes of a group, aligned so optimistic readers load it in two words
+    struct alignas(8) ControlGroup
+    {
+        std::int8_t tags[groupSize];
+    };
+
+    union Slot
+    {
+        Slot() {}
+        ~Slot() {}
+
+        element value;
+    };
+
+    template<typename T>
+    using Rebind = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+    static std::size_t Mix(std::size_t hash)
+    {
+        std::uint64_t mixed = static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+        return static_cast<std::size_t>(mixed ^ (mixed >> 32));
+    }
+
+    static std::int8_t GetTag(std::size_t hash)
+    {
+        return static_cast<std::int8_t>(hash & 0x7F);
+    }
+
+    static std::size_t GetGroup(std::size_t hash)
+    {
+        return hash >> 7;
+    }
+
+    static std::size_t CountTrailingZeros(BitMask mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index = 0;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return static_cast<std::size_t>(__builtin_ctz(mask));
+#endif
+    }
+
+    static void PrefetchAddress(const void* address)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#elif defined(FLAT_HASH_TABLE_SSE2)
+        _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+        (void)address;
+#endif
+    }
+
+#if defined(FLAT_HASH_TABLE_SSE2)
+    static BitMask Match(const std::int8_t* group, std::int8_t tag)
+    {
+        __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<BitMask>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), control)));
+    }
+
+    // Both empty and deleted tags have the sign bit set
+    static BitMask MatchEmptyOrDeleted(const std::int8_t* group)
+    {
+        __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<BitMask>(_mm_movemask_epi8(control));
+    }
+#else
+    static BitMask Match(const std::int8_t* group, std::int8_t tag)
+    {
+        BitMask mask = 0;
+
+        for (std::size_t i = 0; i < groupSize; i++)
+        {
+            mask |= static_cast<BitMask>(group[i] == tag) << i;
+        }
+
+        return mask;
+    }
+
+    static BitMask MatchEmptyOrDeleted(const std::int8_t* group)
+    {
+        BitMask mask = 0;
+
+        for (std::size_t i = 0; i < groupSize; i++)
+        {
+            mask |= static_cast<BitMask>(group[i] < 0) << i;
+        }
+
+        return mask;
+    }
+#endif
+
+    struct Table
+    {
+        explicit Table(std::size_t capacity) :
+            capacity(capacity)
+        {
+            Rebind<ControlGroup> controlAllocator;
+            Rebind<Slot> slotAllocator;
+            Rebind<std::size_t> hashAllocator;
+
+            control = std::allocator_traits<Rebind<ControlGroup>>::allocate(controlAllocator, capacity / groupSize)->tags;
+            std::fill(control, control + capacity, emptyTag);
+            slots = std::allocator_traits<Rebind<Slot>>::allocate(slotAllocator, capacity);
+            hashes = std::allocator_traits<Rebind<std::size_t>>::allocate(hashAllocator, capacity);
+        }
+
+        ~Table()
+        {
+            Free();
+        }
+
+        Table(const Table&) = delete;
+        Table(Table&&) = delete;
+        Table& operator=(const Table&) = delete;
+        Table& operator=(Table&&) = delete;
+
+        // Triangular probing over a power of two amount of groups visits every group once,
+        // and the load factor limit guarantees there is an empty slot somewhere.
+        // Func is called with the first index of each group and returns capacity to continue,
+        // capacity is also returned if every group was visited
+        template<typename Func>
+        std::size_t Probe(std::size_t hash, Func func) const
+        {
+            std::size_t groups = capacity / groupSize;
+            std::size_t group = GetGroup(hash) & (groups - 1);
+
+            for (std::size_t step = 1; step <= groups; step++)
+            {
+                std::size_t base = group * groupSize;
+                std::size_t result = func(base);
+
+                if (result != capacity)
+                {
+                    return result;
+                }
+
+                group = (group + step) & (groups - 1);
+            }
+
+            return capacity;
+        }
+
+        template<typename K>
+        element* Find(const K& key, std::size_t hash) const
+        {
+            std::size_t index = FindIndex(key, hash);
+            return index != capacity ? &slots[index].value : nullptr;
+        }
+
+        // Returns capacity when the key is absent
+        template<typename K>
+        std::size_t FindIndex(const K& key, std::size_t hash) const
+        {
+            if (size == 0)
+            {
+                return capacity;
+            }
+
+            std::size_t index = ProbeForKey<false>(key, hash);
+            return index > capacity ? capacity : index;
+        }
+
+        // Control bytes and slots may be overwritten during the probe, but the arrays
+        // themselves stay alive until the table is destroyed
+        template<typename K>
+        OptimisticReadResult FindOptimistic(const K& key, std::size_t hash, Value& value) const
+        {
+            std::size_t index = ProbeForKey<true>(key, hash);
+
+            if (index == capacity)
+            {
+                return OptimisticReadResult::Retry;
+            }
+
+            if (index > capacity)
+            {
+                return OptimisticReadResult::Absent;
+            }
+
+            value = OptimisticLoad(slots[index].value.second);
+            return OptimisticReadResult::Found;
+        }
+
+        // Returns the index of the key, capacity + 1 if an empty slot was reached
+        // or capacity if there was no empty slot at all. An optimistic probe copies
+        // control bytes and keys with OptimisticLoad
+        template<bool optimistic, typename K>
+        std::size_t ProbeForKey(const K& key, std::size_t hash) const
+        {
+            std::int8_t tag = GetTag(hash);
+            std::size_t groupMask = capacity / groupSize - 1;
+
+            // Slots of the first group are fetched while the control bytes are being loaded
+            const char* firstGroupSlots = reinterpret_cast<const char*>(slots + (GetGroup(hash) & groupMask) * groupSize);
+            PrefetchAddress(firstGroupSlots);
+
+            if constexpr (sizeof(Slot) * groupSize > 64u)
+            {
+                PrefetchAddress(firstGroupSlots + 64);
+            }
+
+            return Probe(hash, [this, &key, tag](std::size_t base)
+            {
+                const std::int8_t* group = control + base;
+                ControlGroup copy;
+
+                if constexpr (optimistic)
+                {
+                    copy = OptimisticLoad(*reinterpret_cast<const ControlGroup*>(group));
+                    group = copy.tags;
+                }
+
+                for (BitMask mask = Match(group, tag); mask; mask &= mask - 1)
+                {
+                    std::size_t candidate = base + CountTrailingZeros(mask);
+
+                    if (IsKey<optimistic>(slots[candidate].value.first, key))
+                    {
+                        return candidate;
+                    }
+                }
+
+                // An empty slot ends the probe sequence
+                return Match(group, emptyTag) ? capacity + 1 : capacity;
+            });
+        }
+
+        template<bool optimistic, typename K>
+        static bool IsKey(const Key& stored, const K& key)
+        {
+            if constexpr (optimistic)
+            {
+                return OptimisticLoad(stored) == key;
+            }
+            else
+            {
+                return stored == key;
+            }
+        }
+
+        template<typename... Args>
+        element* Insert(std::size_t hash, Args&&... args)
+        {
+            std::size_t index = Probe(hash, [this](std::size_t base)
+            {
+                BitMask mask = MatchEmptyOrDeleted(control + base);
+                return mask ? base + CountTrailingZeros(mask) : capacity;
+            });
+
+            if constexpr (optimisticReads)
+            {
+                OptimisticStore(slots[index].value, element(std::forward<Args>(args)...));
+            }
+            else
+            {
+                new (&slots[index].value) element(std::forward<Args>(args)...);
+            }
+
+            if (control[index] == deletedTag)
+            {
+                --deleted;
+            }
+
+            SetControl(index, GetTag(hash));
+            hashes[index] = hash;
+            ++size;
+
+            return &slots[index].value;
+        }
+
+        template<typename K>
+        bool Erase(const K& key, std::size_t hash)
+        {
+            std::size_t index = FindIndex(key, hash);
+
+            if (index == capacity)
+            {
+                return false;
+            }
+
+            EraseAt(index);
+            return true;
+        }
+
+        void EraseAt(std::size_t index)
+        {
+            slots[index].value.~element();
+            SetControl(index, deletedTag);
+            --size;
+            ++deleted;
+        }
+
+        bool IsFull(std::size_t index) const
+        {
+            return control[index] >= 0;
+        }
+
+        // Optimistic readers may be loading the control byte
+        void SetControl(std::size_t index, std::int8_t tag)
+        {
+            if constexpr (optimisticReads)
+            {
+                OptimisticStore(control[index], tag);
+            }
+            else
+            {
+                control[index] = tag;
+            }
+        }
+
+        template<typename Func>
+        void ForEach(Func& func) const
+        {
+            for (std::size_t i = 0; i < capacity && size > 0; i++)
+            {
+                if (IsFull(i))
+                {
+                    func(std::as_const(slots[i].value));
+                }
+            }
+        }
+
+        // Rehashes the elements into the same arrays without tombstones. The arrays stay where
+        // they are, so an optimistic reader running meanwhile only fails its validation
+        void DropDeleted()
+        {
+            std::vector<std::pair<std::size_t, element>, Rebind<std::pair<std::size_t, element>>> elements;
+            elements.reserve(size);
+
+            for (std::size_t i = 0; i < capacity; i++)
+            {
+                if (IsFull(i))
+                {
+                    elements.emplace_back(hashes[i], std::move(slots[i].value));
+                    slots[i].value.~element();
+                }
+            }
+
+            for (std::size_t i = 0; i < capacity; i++)
+            {
+                SetControl(i, emptyTag);
+            }
+
+            size = 0;
+            deleted = 0;
+
+            for (auto& [hash, value] : elements)
+            {
+                Insert(hash, std::move(value));
+            }
+        }
+
+        void Free()
+        {
+            if (!control)
+            {
+                return;
+            }
+
+            for (std::size_t i = 0; i < capacity; i++)
+            {
+                if (IsFull(i))
+                {
+                    slots[i].value.~element();
+                }
+            }
+
+            Rebind<ControlGroup> controlAllocator;
+            Rebind<Slot> slotAllocator;
+            Rebind<std::size_t> hashAllocator;
+
+            std::allocator_traits<Rebind<ControlGroup>>::deallocate(controlAllocator,
+                reinterpret_cast<ControlGroup*>(control), capacity / groupSize);
+            std::allocator_traits<Rebind<Slot>>::deallocate(slotAllocator, slots, capacity);
+            std::allocator_traits<Rebind<std::size_t>>::deallocate(hashAllocator, hashes, capacity);
+
+            control = nullptr;
+            slots = nullptr;
+            hashes = nullptr;
+        }
+
+        std::int8_t* control = nullptr;
+        Slot* slots = nullptr;
+        // Full hashes are only read when moving elements, so they live apart from the probed data
+        std::size_t* hashes = nullptr;
+        std::size_t capacity = 0;
+        std::size_t size = 0;
+        std::size_t deleted = 0;
+        Table* nextRetired = nullptr;
+    };
+
+    template<typename K>
+    Value* FindMixed(const K& key, std::size_t hash) const
+    {
+        for (const Table* table : { current.load(std::memory_order_relaxed), old.load(std::memory_order_relaxed) })
+        {
+            if (element* found = table ? table->Find(key, hash) : nullptr)
+            {
+                return &found->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    static Table* CreateTable(std::size_t capacity)
+    {
+        return AllocateObject<Table, Allocator>(capacity);
+    }
+
+    static void DestroyTable(Table* table)
+    {
+        if (table)
+        {
+            DeallocateObject<Allocator>(table);
+        }
+    }
+
+    // With optimistic reads the arrays of a migrated table are kept, so a reader never touches
+    // freed memory. Tables are only retired when growing, so all of them together are smaller
+    // than the current one
+    void RetireTable(Table* table)
+    {
+        if constexpr (optimisticReads)
+        {
+            table->nextRetired = retiredTables;
+            retiredTables = table;
+        }
+        else
+        {
+            DestroyTable(table);
+        }
+    }
+
+    // Keeps at least 1/8 of the slots empty. When the table is full of tombstones rather
+    // than elements they are dropped in place, otherwise it grows into a table of twice the capacity
+    void GrowIfNeeded()
+    {
+        Table* currentTable = current.load(std::memory_order_relaxed);
+
+        if (currentTable && (currentTable->size + currentTable->deleted + 1) * 8 <= currentTable->capacity * 7)
+        {
+            return;
+        }
+
+        while (old.load(std::memory_order_relaxed))
+        {
+            MigrateGroups();
+        }
+
+        std::size_t capacity = initialCapacity;
+
+        if (currentTable)
+        {
+            if ((currentTable->size + currentTable->deleted + 1) * 8 <= currentTable->capacity * 7)
+            {
+                return;
+            }
+
+            if ((currentTable->size + 1) * 16 <= currentTable->capacity * 7)
+            {
+                currentTable->DropDeleted();
+                return;
+            }
+
+            capacity = currentTable->capacity * 2;
+        }
+
+        migratedGroups = 0;
+        old.store(currentTable, std::memory_order_release);
+        current.store(CreateTable(capacity), std::memory_order_release);
+    }
+
+    // Moved elements leave tombstones behind, so probing of the old table stays correct
+    void MigrateGroups()
+    {
+        Table* oldTable = old.load(std::memory_order_relaxed);
+
+        if (!oldTable)
+        {
+            return;
+        }
+
+        Table* currentTable = current.load(std::memory_order_relaxed);
+        std::size_t groups = oldTable->capacity / groupSize;
+        std::size_t last = std::min(migratedGroups + migrationStep, groups);
+
+        for (; migratedGroups < last; migratedGroups++)
+        {
+            std::size_t base = migratedGroups * groupSize;
+
+            for (std::size_t i = base; i < base + groupSize; i++)
+            {
+                if (oldTable->IsFull(i))
+                {
+                    currentTable->Insert(oldTable->hashes[i], std::move(oldTable->slots[i].value));
+                    oldTable->EraseAt(i);
+                }
+            }
+        }
+
+        if (migratedGroups == groups)
+        {
+            old.store(nullptr, std::memory_order_release);
+            migratedGroups = 0;
+            RetireTable(oldTable);
+        }
+    }
+
+    std::atomic<Table*> current = nullptr;
+    std::atomic<Table*> old = nullptr;
+    std::size_t migratedGroups = 0;
+
+    Table* retiredTables = nullptr;
+};
@@ -4,6 +4,8 @@
 #include <future>
 #include <algorithm>
 
+#include "TraceSpans.h"
+
 inline std::size_t GetOptimalAmountOfThreads(std::size_t amountOfElements)
 {
     constexpr std::size_t blockSize = 256u;
@@ -22,6 +24,7 @@ void ParallelForEach(It begin, It end, Func func)
 
     auto processingLambda = [func](It blockBegin, It blockEnd)
     {
+        TRACE_SPAN_ARG("ParallelForEach::Block", std::distance(blockBegin, blockEnd));
         std::for_each(blockBegin, blockEnd, func);
     };
 
@@ -7,6 +7,7 @@
 #include <cassert>
 
 #include "CountedPtr.h"
+#include "AllocatorHelpers.h"
 
 namespace LockFree
 {
@@ -16,15 +17,15 @@ namespace LockFree
         int externalCounters : 3;
     };
 
-    template<typename T>
+    template<typename T, typename Allocator>
     struct Node
     {
         std::atomic<T*> data;
         std::atomic<Counter> counter;
-        std::atomic<CountedPtr<Node<T>>> next;
+        std::atomic<CountedPtr<Node>> next;
 
         Node() : 
-            data(nullptr), counter(Counter{ 0, 2 }), next(CountedPtr<Node<T>>{ nullptr, 0 }) 
+            data(nullptr), counter(Counter{ 0, 2 }), next(CountedPtr<Node>{ nullptr, 0 }) 
         {}
 
         void Release()
@@ -43,20 +44,21 @@ namespace LockFree
 
             if (newCounter.internalCounter == 0 && newCounter.externalCounters == 0)
             {
-                delete this;
+                DeallocateObject<Allocator>(this);
             }
         }
     };
 
-    template<typename T>
+    template<typename T, typename Allocator = std::allocator<T>>
     class Queue
     {
     public:
-        using CountedPtrElement = CountedPtr<Node<T>>;
+        using NodeType = Node<T, Allocator>;
+        using CountedPtrElement = CountedPtr<NodeType>;
 
         Queue()
         {
-            CountedPtrElement blankElement { new Node<T>(), 1 };
+            CountedPtrElement blankElement { AllocateObject<NodeType, Allocator>(), 1 };
 
             head.store(blankElement, std::memory_order_release);
             tail.store(blankElement, std::memory_order_release);
@@ -66,15 +68,15 @@ namespace LockFree
         {
             while (Pop());
 
-            Node<T>* blankNodePtr = head.load(std::memory_order_relaxed).ptr;
-            delete blankNodePtr;
+            NodeType* blankNodePtr = head.load(std::memory_order_relaxed).ptr;
+            DeallocateObject<Allocator>(blankNodePtr);
         }
 
         void Push(const T& value)
         {
             std::unique_ptr<T> data = std::make_unique<T>(value);
 
-            CountedPtrElement newElement { new Node<T>(), 1 };
+            CountedPtrElement newElement { AllocateObject<NodeType, Allocator>(), 1 };
 
             for (;;)
             {
@@ -90,7 +92,7 @@ namespace LockFree
                     if (!oldTail->next.compare_exchange_strong(oldNext, newElement,
                         std::memory_order_acq_rel, std::memory_order_acquire))
                     {
-                        delete newElement.ptr;
+                        DeallocateObject<Allocator>(newElement.ptr);
                         newElement = oldNext;
                     }
 
@@ -104,7 +106,7 @@ namespace LockFree
                         std::memory_order_acq_rel, std::memory_order_acquire))
                     {
                         oldNext = newElement;
-                        newElement.ptr = new Node<T>();
+                        newElement.ptr = AllocateObject<NodeType, Allocator>();
                     }
 
                     UpdateTail(oldTail, oldNext);
@@ -180,7 +182,7 @@ namespace LockFree
 
             if (newCounter.internalCounter == 0 && newCounter.externalCounters == 0)
             {
-                delete element.ptr;
+                DeallocateObject<Allocator>(element.ptr);
             }
         }
 
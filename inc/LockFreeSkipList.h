@@ -0,0 +1,495 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+
+#include "EpochReclamation.h"
+
+namespace LockFree
+{
+    // Ordered map on a lock-free skip list (Herlihy, Shavit). A node is logically deleted by
+    // marking the lowest bit of its next pointers, top level first, the mark of the bottom
+    // level decides which Erase wins. Marked nodes are unlinked by whoever walks past them
+    // and are freed through epoch based reclamation, so readers never touch freed memory.
+    // Values are immutable once inserted, lookups return copies
+    template<typename Key, typename Value, typename Compare = std::less<Key>,
+        typename Allocator = std::allocator<std::pair<const Key, Value>>>
+    class SkipListMap
+    {
+    public:
+        using element = std::pair<const Key, Value>;
+
+        static constexpr int maxHeight = 24;
+
+        class Iterator;
+
+        SkipListMap(Compare compare = Compare()) :
+            compare(std::move(compare)),
+            head(CreateNode(maxHeight))
+        { }
+
+        ~SkipListMap()
+        {
+            Node* node = Unmark(head->Next(0).load(std::memory_order_relaxed));
+
+            while (node)
+            {
+                Node* next = Unmark(node->Next(0).load(std::memory_order_relaxed));
+                node->value.~element();
+                DestroyNode(node);
+                node = next;
+            }
+
+            DestroyNode(head);
+        }
+
+        // Does nothing if the key is already present
+        bool Insert(const Key& key, const Value& value)
+        {
+            EpochReclamation::Guard guard;
+
+            std::array<Node*, maxHeight> preds;
+            std::array<Node*, maxHeight> succs;
+
+            while (true)
+            {
+                if (FindAndClean(key, preds, succs))
+                {
+                    return false;
+                }
+
+                int height = GetRandomHeight();
+                Node* node = CreateNode(height);
+                new (&node->value) element(key, value);
+
+                for (int level = 0; level < height; level++)
+                {
+                    node->Next(level).store(ToLink(succs[level]), std::memory_order_relaxed);
+                }
+
+                std::uintptr_t expected = ToLink(succs[0]);
+
+                if (!preds[0]->Next(0).compare_exchange_strong(expected, ToLink(node),
+                    std::memory_order_release, std::memory_order_relaxed))
+                {
+                    node->value.~element();
+                    DestroyNode(node);
+                    continue;
+                }
+
+                LinkUpperLevels(node, preds, succs);
+                return true;
+            }
+        }
+
+        std::optional<Value> Find(const Key& key) const
+        {
+            EpochReclamation::Guard guard;
+
+            Node* node = SkipMarked(FindNode(key));
+
+            if (!node || !IsEqual(node->value.first, key))
+            {
+                return std::nullopt;
+            }
+
+            return node->value.second;
+        }
+
+        bool Contains(const Key& key) const
+        {
+            EpochReclamation::Guard guard;
+
+            Node* node = SkipMarked(FindNode(key));
+            return node && IsEqual(node->value.first, key);
+        }
+
+        bool Erase(const Key& key)
+        {
+            EpochReclamation::Guard guard;
+
+            std::array<Node*, maxHeight> preds;
+            std::array<Node*, maxHeight> succs;
+
+            if (!FindAndClean(key, preds, succs))
+            {
+                return false;
+            }
+
+            Node* node = succs[0];
+
+            for (int level = node->height - 1; level > 0; level--)
+            {
+                std::uintptr_t next = node->Next(level).load(std::memory_order_relaxed);
+
+                while (!IsMarked(next) && !node->Next(level).compare_exchange_weak(next, next | markBit,
+                    std::memory_order_release, std::memory_order_relaxed))
+                { }
+            }
+
+            std::uintptr_t next = node->Next(0).load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                if (IsMarked(next))
+                {
+                    return false;
+                }
+
+                if (node->Next(0).compare_exchange_weak(next, next | markBit,
+                    std::memory_order_release, std::memory_order_relaxed))
+                {
+                    FindAndClean(key, preds, succs);
+                    Release(node);
+
+                    return true;
+                }
+            }
+        }
+
+        // Weakly consistent: elements inserted or erased during the iteration may or may not
+        // be visited. Iterators pin the reclamation epoch of the thread that created them,
+        // so they shouldn't be kept for long or passed to other threads
+        Iterator begin() const
+        {
+            EpochReclamation::Guard guard;
+            return Iterator(SkipMarked(Unmark(head->Next(0).load(std::memory_order_acquire))));
+        }
+
+        Iterator end() const
+        {
+            return Iterator();
+        }
+
+        // First element not less than key
+        Iterator LowerBound(const Key& key) const
+        {
+            EpochReclamation::Guard guard;
+            return Iterator(SkipMarked(FindNode(key)));
+        }
+
+        SkipListMap(const SkipListMap&) = delete;
+        SkipListMap(SkipListMap&&) = delete;
+        SkipListMap& operator=(const SkipListMap&) = delete;
+        SkipListMap& operator=(SkipListMap&&) = delete;
+
+    private:
+        static constexpr std::uintptr_t markBit = 1u;
+
+        struct Node
+        {
+            explicit Node(int height) :
+                height(height)
+            { }
+
+            ~Node() {}
+
+            std::atomic<std::uintptr_t>& Next(int level)
+            {
+                return reinterpret_cast<std::atomic<std::uintptr_t>*>(this + 1)[level];
+            }
+
+            union
+            {
+                element value;
+            };
+
+            int height;
+            // The inserter still linking upper levels and the winning Erase both hold a reference,
+            // the node is retired when both are done with it
+            std::atomic<int> references = 2;
+        };
+
+        using ByteAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::byte>;
+
+        static_assert(sizeof(Node) % alignof(std::atomic<std::uintptr_t>) == 0, "Links have to be aligned");
+
+        static std::size_t GetNodeSize(int height)
+        {
+            return sizeof(Node) + sizeof(std::atomic<std::uintptr_t>) * static_cast<std::size_t>(height);
+        }
+
+        static Node* CreateNode(int height)
+        {
+            ByteAllocator allocator;
+            std::byte* memory = std::allocator_traits<ByteAllocator>::allocate(allocator, GetNodeSize(height));
+            Node* node = new (memory) Node(height);
+
+            for (int level = 0; level < height; level++)
+            {
+                new (&node->Next(level)) std::atomic<std::uintptr_t>(0);
+            }
+
+            return node;
+        }
+
+        static void DestroyNode(Node* node)
+        {
+            std::size_t size = GetNodeSize(node->height);
+            node->~Node();
+
+            ByteAllocator allocator;
+            std::allocator_traits<ByteAllocator>::deallocate(allocator, reinterpret_cast<std::byte*>(node), size);
+        }
+
+        static void DeleteRetired(void* ptr)
+        {
+            Node* node = static_cast<Node*>(ptr);
+            node->value.~element();
+            DestroyNode(node);
+        }
+
+        static void Release(Node* node)
+        {
+            if (node->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                EpochReclamation::Retire(node, &DeleteRetired);
+            }
+        }
+
+        static bool IsMarked(std::uintptr_t link)
+        {
+            return (link & markBit) != 0;
+        }
+
+        static Node* Unmark(std::uintptr_t link)
+        {
+            return reinterpret_cast<Node*>(link & ~markBit);
+        }
+
+        static std::uintptr_t ToLink(Node* node)
+        {
+            return reinterpret_cast<std::uintptr_t>(node);
+        }
+
+        bool IsEqual(const Key& left, const Key& right) const
+        {
+            return !compare(left, right) && !compare(right, left);
+        }
+
+        // Geometric distribution with p = 1/2
+        static int GetRandomHeight()
+        {
+            thread_local std::uint64_t state = 0x9E3779B97F4A7C15ull ^ reinterpret_cast<std::uintptr_t>(&state);
+
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+
+            int height = 1;
+
+            for (std::uint64_t bits = state; (bits & 1u) && height < maxHeight; bits >>= 1)
+            {
+                height++;
+            }
+
+            return height;
+        }
+
+        // Fills the predecessors and successors of key on every level, unlinking marked nodes
+        // on the way. Returns whether the bottom level successor holds key
+        bool FindAndClean(const Key& key, std::array<Node*, maxHeight>& preds, std::array<Node*, maxHeight>& succs) const
+        {
+        retry:
+            Node* pred = head;
+
+            for (int level = maxHeight - 1; level >= 0; level--)
+            {
+                Node* curr = Unmark(pred->Next(level).load(std::memory_order_acquire));
+
+                while (curr)
+                {
+                    std::uintptr_t succ = curr->Next(level).load(std::memory_order_acquire);
+
+                    while (IsMarked(succ))
+                    {
+                        std::uintptr_t expected = ToLink(curr);
+
+                        if (!pred->Next(level).compare_exchange_strong(expected, succ & ~markBit,
+                            std::memory_order_acq_rel, std::memory_order_relaxed))
+                        {
+                            goto retry;
+                        }
+
+                        curr = Unmark(succ);
+
+                        if (!curr)
+                        {
+                            break;
+                        }
+
+                        succ = curr->Next(level).load(std::memory_order_acquire);
+                    }
+
+                    if (!curr || !compare(curr->value.first, key))
+                    {
+                        break;
+                    }
+
+                    pred = curr;
+                    curr = Unmark(succ);
+                }
+
+                preds[level] = pred;
+                succs[level] = curr;
+            }
+
+            return succs[0] && IsEqual(succs[0]->value.first, key);
+        }
+
+        // Read-only search, passes over marked nodes without unlinking them.
+        // Returns the first bottom level node not less than key
+        Node* FindNode(const Key& key) const
+        {
+            Node* pred = head;
+            Node* curr = nullptr;
+
+            for (int level = maxHeight - 1; level >= 0; level--)
+            {
+                curr = Unmark(pred->Next(level).load(std::memory_order_acquire));
+
+                while (curr && compare(curr->value.first, key))
+                {
+                    pred = curr;
+                    curr = Unmark(curr->Next(level).load(std::memory_order_acquire));
+                }
+            }
+
+            return curr;
+        }
+
+        static Node* SkipMarked(Node* node)
+        {
+            while (node)
+            {
+                std::uintptr_t next = node->Next(0).load(std::memory_order_acquire);
+
+                if (!IsMarked(next))
+                {
+                    return node;
+                }
+
+                node = Unmark(next);
+            }
+
+            return nullptr;
+        }
+
+        // Links levels above the bottom one, gives up as soon as the node is marked by an Erase.
+        // If that happened, the node may have been linked on a level after the Erase cleaned up,
+        // so one more search unlinks it before the reference is dropped
+        void LinkUpperLevels(Node* node, std::array<Node*, maxHeight>& preds, std::array<Node*, maxHeight>& succs)
+        {
+            const Key& key = node->value.first;
+
+            for (int level = 1; level < node->height; level++)
+            {
+                while (true)
+                {
+                    std::uintptr_t next = node->Next(level).load(std::memory_order_acquire);
+
+                    if (IsMarked(next))
+                    {
+                        goto done;
+                    }
+
+                    if (next != ToLink(succs[level]) && !node->Next(level).compare_exchange_strong(next,
+                        ToLink(succs[level]), std::memory_order_release, std::memory_order_relaxed))
+                    {
+                        goto done;
+                    }
+
+                    std::uintptr_t expected = ToLink(succs[level]);
+
+                    if (preds[level]->Next(level).compare_exchange_strong(expected, ToLink(node),
+                        std::memory_order_release, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+
+                    FindAndClean(key, preds, succs);
+
+                    if (succs[0] != node)
+                    {
+                        goto done;
+                    }
+                }
+            }
+
+        done:
+            if (IsMarked(node->Next(0).load(std::memory_order_acquire)))
+            {
+                FindAndClean(key, preds, succs);
+            }
+
+            Release(node);
+        }
+
+        Compare compare;
+        Node* head;
+
+    public:
+        class Iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = element;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const element*;
+            using reference = const element&;
+
+            Iterator() = default;
+
+            reference operator*() const
+            {
+                return node->value;
+            }
+
+            pointer operator->() const
+            {
+                return &node->value;
+            }
+
+            Iterator& operator++()
+            {
+                node = SkipMarked(Unmark(node->Next(0).load(std::memory_order_acquire)));
+                return *this;
+            }
+
+            Iterator operator++(int)
+            {
+                Iterator result = *this;
+                ++*this;
+                return result;
+            }
+
+            bool operator==(const Iterator& other) const
+            {
+                return node == other.node;
+            }
+
+            bool operator!=(const Iterator& other) const
+            {
+                return node != other.node;
+            }
+
+        private:
+            explicit Iterator(Node* node) :
+                node(node)
+            { }
+
+            EpochReclamation::Guard guard;
+            Node* node = nullptr;
+
+            friend class SkipListMap;
+        };
+    };
+}
@@ -3,8 +3,11 @@
 #include <atomic>
 #include <type_traits>
 #include <memory>
+#include <iterator>
+#include <utility>
 
 #include "CountedPtr.h"
+#include "AllocatorHelpers.h"
 
 template<typename T>
 struct Node
@@ -14,15 +17,168 @@ struct Node
     std::atomic<int> internalCount;
 };
 
-template<typename T>
+template<typename T, typename Allocator = std::allocator<T>>
 class Stack
 {
 public:
     using CountedPtrElement = CountedPtr<Node<T>>;
 
+    // Privately owned chain of nodes, either detached from the stack by PopAll
+    // or prepared for PushList. Iterates from the most recently pushed element
+    class Batch
+    {
+    public:
+        class Iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+            using pointer = T*;
+            using reference = T&;
+
+            explicit Iterator(Node<T>* node = nullptr) :
+                node(node)
+            { }
+
+            T& operator*() const
+            {
+                return *node->data;
+            }
+
+            T* operator->() const
+            {
+                return node->data.get();
+            }
+
+            Iterator& operator++()
+            {
+                node = node->next.ptr;
+                return *this;
+            }
+
+            Iterator operator++(int)
+            {
+                Iterator result = *this;
+                ++(*this);
+                return result;
+            }
+
+            bool operator==(const Iterator& other) const
+            {
+                return node == other.node;
+            }
+
+            bool operator!=(const Iterator& other) const
+            {
+                return node != other.node;
+            }
+
+        private:
+            Node<T>* node;
+        };
+
+        Batch() = default;
+
+        Batch(Batch&& other) noexcept :
+            first(std::exchange(other.first, nullptr)),
+            last(std::exchange(other.last, nullptr))
+        { }
+
+        Batch& operator=(Batch&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Clear();
+                first = std::exchange(other.first, nullptr);
+                last = std::exchange(other.last, nullptr);
+            }
+
+            return *this;
+        }
+
+        ~Batch()
+        {
+            Clear();
+        }
+
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+        template<typename Param>
+        void Push(Param&& value)
+        {
+            Node<T>* node = AllocateObject<Node<T>, Allocator>();
+            node->data = std::make_unique<T>(std::forward<Param>(value));
+            node->next = { first, 1 };
+
+            if (!last)
+            {
+                last = node;
+            }
+
+            first = node;
+        }
+
+        // Reverses the chain locally, so iteration follows the push order
+        void Reverse()
+        {
+            Node<T>* previous = nullptr;
+            Node<T>* current = first;
+            last = first;
+
+            while (current)
+            {
+                Node<T>* next = current->next.ptr;
+                current->next = { previous, 1 };
+                previous = current;
+                current = next;
+            }
+
+            first = previous;
+        }
+
+        void Clear()
+        {
+            while (first)
+            {
+                Node<T>* next = first->next.ptr;
+                DeallocateObject<Allocator>(first);
+                first = next;
+            }
+
+            last = nullptr;
+        }
+
+        bool Empty() const
+        {
+            return first == nullptr;
+        }
+
+        Iterator begin() const
+        {
+            return Iterator(first);
+        }
+
+        Iterator end() const
+        {
+            return Iterator();
+        }
+
+    private:
+        Batch(Node<T>* first, Node<T>* last) :
+            first(first), last(last)
+        { }
+
+        Node<T>* first = nullptr;
+        Node<T>* last = nullptr;
+
+        friend class Stack;
+    };
+
     void Push(const T& value)
     {
-        Node<T>* node = new Node<T>();
+        Node<T>* node = AllocateObject<Node<T>, Allocator>();
         node->data = std::make_unique<T>(value);
         node->next = head.load(std::memory_order_relaxed);
         CountedPtrElement countedPtr = { node, 1 };
@@ -30,6 +186,44 @@ public:
         while (!head.compare_exchange_weak(node->next, countedPtr, std::memory_order_release, std::memory_order_relaxed));
     }
 
+    // Publishes the whole chain with a single CAS, the last element of the range ends up on top
+    template<typename It>
+    void PushList(It begin, It end)
+    {
+        Batch batch;
+
+        for (; begin != end; ++begin)
+        {
+            batch.Push(*begin);
+        }
+
+        PushList(std::move(batch));
+    }
+
+    void PushList(Batch&& batch)
+    {
+        if (batch.Empty())
+        {
+            return;
+        }
+
+        if (!batch.last)
+        {
+            // Batches detached by PopAll don't track their last node
+            batch.last = batch.first;
+            while (batch.last->next.ptr)
+            {
+                batch.last = batch.last->next.ptr;
+            }
+        }
+
+        Node<T>* last = std::exchange(batch.last, nullptr);
+        CountedPtrElement countedPtr = { std::exchange(batch.first, nullptr), 1 };
+        last->next = head.load(std::memory_order_relaxed);
+
+        while (!head.compare_exchange_weak(last->next, countedPtr, std::memory_order_release, std::memory_order_relaxed));
+    }
+
     std::unique_ptr<T> Pop()
     {
         while (true)
@@ -44,7 +238,7 @@ public:
                 int difference = old.count - 2;
                 if (old->internalCount.fetch_add(difference, std::memory_order_release) == -difference)
                 {
-                    delete old.ptr;
+                    DeallocateObject<Allocator>(old.ptr);
                 }
 
                 return result;
@@ -57,17 +251,44 @@ public:
 
             if (old->internalCount.fetch_sub(1, std::memory_order_acquire) == 1)
             {
-                delete old.ptr;
+                DeallocateObject<Allocator>(old.ptr);
             }
         }
     }
 
-    ~Stack()
+    // Detaches every element with a single exchange
+    Batch PopAll()
     {
-        while (head.ptr)
+        CountedPtrElement old = head.exchange({ nullptr, 1 }, std::memory_order_acquire);
+
+        if (!old.ptr)
+        {
+            return {};
+        }
+
+        // Only the top node could have been referenced by concurrent Pop calls, nodes
+        // below it are exclusively owned now. Data and next have to be read before
+        // publishing the count, since the last reader deletes the node
+        std::unique_ptr<T> data = std::move(old->data);
+        Node<T>* next = old->next.ptr;
+
+        int difference = old.count - 1;
+        if (old->internalCount.fetch_add(difference, std::memory_order_acq_rel) == -difference)
         {
-            Pop();
+            old->data = std::move(data);
+            return Batch(old.ptr, nullptr);
         }
+
+        Node<T>* node = AllocateObject<Node<T>, Allocator>();
+        node->data = std::move(data);
+        node->next = { next, 1 };
+
+        return Batch(node, nullptr);
+    }
+
+    ~Stack()
+    {
+        PopAll();
     }
 
 private:
@@ -10,17 +10,236 @@
 #include <functional>
 #include <vector>
 #include <iostream>
+#include <type_traits>
 
 #include "ThreadPool.h"
+#include "SortingNetworks.h"
+#include "TraceSpans.h"
 
 inline size_t threshold = 4096;
 
+// Ranges up to this length are sorted by the base case instead of being split further.
+// Specialize it to tune a type, types with sorting networks default to the network size
+template<typename T, typename = void>
+struct MergeSortCutoff : std::integral_constant<std::size_t, 16> {};
+
+template<typename T>
+struct MergeSortCutoff<T, std::enable_if_t<SortingNetworks::HasRegisters<T>::value>> :
+    std::integral_constant<std::size_t, SortingNetworks::maxLength> {};
+
+template<typename Iter, typename Comp>
+void InsertionSort(Iter begin, Iter end, Comp comp)
+{
+    if (begin == end)
+    {
+        return;
+    }
+
+    for (Iter it = std::next(begin); it != end; ++it)
+    {
+        auto value = std::move(*it);
+        Iter hole = it;
+
+        while (hole != begin && comp(value, *std::prev(hole)))
+        {
+            *hole = std::move(*std::prev(hole));
+            --hole;
+        }
+
+        *hole = std::move(value);
+    }
+}
+
+template<typename Iter, typename Comp>
+void SortSmallRange(Iter begin, Iter end, Comp comp)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+    constexpr bool isContiguous = std::is_pointer_v<Iter> || std::is_same_v<Iter, typename std::vector<Value>::iterator>;
+
+    if constexpr (isContiguous && SortingNetworks::isSupported<Value, Comp>)
+    {
+        std::size_t length = std::distance(begin, end);
+
+        if (length > 1 && length <= SortingNetworks::maxLength)
+        {
+            SortingNetworks::Sort(&*begin, length);
+            return;
+        }
+    }
+
+    InsertionSort(begin, end, comp);
+}
+
+// Amount of elements of the first range among the first k elements of their stable merge,
+// found by binary search over the split point (co-ranking). Ties go to the first range
+template<typename Iter, typename Comp>
+std::size_t CoRank(std::size_t k, Iter first1, std::size_t length1, Iter first2, std::size_t length2, Comp comp)
+{
+    std::size_t low = k > length2 ? k - length2 : 0;
+    std::size_t high = std::min(k, length1);
+
+    while (low < high)
+    {
+        std::size_t i = low + (high - low) / 2;
+
+        if (!comp(first2[k - i - 1], first1[i]))
+        {
+            low = i + 1;
+        }
+        else
+        {
+            high = i;
+        }
+    }
+
+    return low;
+}
+
+// Merges sorted [first1, last1) and [first2, last2) by moving the elements to out
+template<typename InIt, typename OutIt, typename Comp>
+void MoveMerge(InIt first1, InIt last1, InIt first2, InIt last2, OutIt out, Comp comp)
+{
+    std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+        std::make_move_iterator(first2), std::make_move_iterator(last2), out, comp);
+}
+
+// Moves the merge of [begin, mid) and [mid, end) to out as parts independent tasks of equal
+// output length. runParts(parts, func) has to call func(part) for every part and return
+// once all of them are done
+template<typename InIt, typename OutIt, typename Comp, typename RunParts>
+void ParallelMerge(InIt begin, InIt mid, InIt end, OutIt out, Comp comp, std::size_t parts, RunParts runParts)
+{
+    if (parts <= 1)
+    {
+        MoveMerge(begin, mid, mid, end, out, comp);
+        return;
+    }
+
+    std::size_t length1 = std::distance(begin, mid);
+    std::size_t length2 = std::distance(mid, end);
+    std::size_t length = length1 + length2;
+
+    // Parts move elements out of the input, so every split is found before any merge starts
+    std::vector<std::size_t> splits(parts + 1);
+
+    for (std::size_t part = 0; part <= parts; part++)
+    {
+        splits[part] = CoRank(length * part / parts, begin, length1, mid, length2, comp);
+    }
+
+    runParts(parts, [=, &splits](std::size_t part)
+    {
+        std::size_t firstOutput = length * part / parts;
+        std::size_t lastOutput = length * (part + 1) / parts;
+        std::size_t first1 = splits[part];
+        std::size_t last1 = splits[part + 1];
+
+        TRACE_SPAN_ARG("MergeSort::MergePart", lastOutput - firstOutput);
+        MoveMerge(begin + first1, begin + last1, mid + (firstOutput - first1), mid + (lastOutput - last1),
+            out + firstOutput, comp);
+    });
+}
+
+// Buffered sorts alternate source and destination by recursion depth (ping-pong): both halves
+// are sorted into the opposite storage of where the result has to end up, so every level
+// makes a single moving pass. The buffer has to be as long as the range
+template<typename Iter, typename BufferIt, typename Merge>
+void MergeSortedHalves(Iter begin, Iter end, BufferIt bufferIt, bool toBuffer, Merge merge)
+{
+    auto length = std::distance(begin, end);
+    auto half = length / 2;
+
+    if (toBuffer)
+    {
+        merge(begin, begin + half, end, bufferIt);
+    }
+    else
+    {
+        merge(bufferIt, bufferIt + half, bufferIt + length, begin);
+    }
+}
+
+template<typename Iter, typename BufferIt, typename Comp>
+bool SortLeaf(Iter begin, Iter end, BufferIt bufferIt, bool toBuffer, Comp comp)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
+    if (static_cast<std::size_t>(std::distance(begin, end)) > MergeSortCutoff<Value>::value)
+    {
+        return false;
+    }
+
+    SortSmallRange(begin, end, comp);
+
+    if (toBuffer)
+    {
+        std::move(begin, end, bufferIt);
+    }
+
+    return true;
+}
+
+// Merges shorter than the threshold aren't split, longer ones get a part per threshold elements
+inline std::size_t GetMergeParts(std::size_t length, std::size_t threadsAvailable)
+{
+    return std::max<std::size_t>(std::min(length / threshold, threadsAvailable), 1u);
+}
+
+template<typename Func>
+void RunPartsAsync(std::size_t parts, Func func)
+{
+    std::vector<std::future<void>> futures;
+    futures.reserve(parts - 1);
+
+    for (std::size_t part = 1; part < parts; part++)
+    {
+        futures.push_back(std::async(func, part));
+    }
+
+    func(0);
+
+    for (auto& future : futures)
+    {
+        future.get();
+    }
+}
+
+template<typename ThreadPool, typename Func>
+void RunPartsPool(ThreadPool& pool, std::size_t parts, Func func)
+{
+    std::vector<std::future<void>> futures;
+    futures.reserve(parts - 1);
+
+    for (std::size_t part = 1; part < parts; part++)
+    {
+        futures.push_back(pool.Enqueue([func, part]()
+        {
+            func(part);
+        }));
+    }
+
+    func(0);
+
+    for (auto& future : futures)
+    {
+        pool.WaitFor(future);
+    }
+
+    for (auto& future : futures)
+    {
+        future.get();
+    }
+}
+
 template<typename Iter, typename Comp>
 void MergeSortInternal(Iter begin, Iter end, Comp comp, unsigned int availableThreads) 
 {
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
     auto length = std::distance(begin, end);
-    if (length <= 1) 
+    if (static_cast<std::size_t>(length) <= MergeSortCutoff<Value>::value) 
     {
+        SortSmallRange(begin, end, comp);
         return;
     }
     
@@ -47,119 +266,158 @@ void MergeSortInternal(Iter begin, Iter end, Comp comp, unsigned int availableTh
     std::inplace_merge(begin, mid, end, comp);
 }
 
-template<typename Iter, typename Comp, typename ThreadPool>
-void MergeSortPoolInternal(Iter begin, Iter end, ThreadPool& pool, Comp comp) 
+template<typename Iter, typename Comp, typename ThreadPool, typename BufferIt>
+void MergeSortPoolInternal(Iter begin, Iter end, ThreadPool& pool, Comp comp, BufferIt bufferIt, bool toBuffer) 
 {
-    auto length = std::distance(begin, end);
-    if (length <= 1) 
+    if (SortLeaf(begin, end, bufferIt, toBuffer, comp))
     {
         return;
     }
-    
+
+    auto length = std::distance(begin, end);
     Iter mid = begin + length / 2;
      
     if (length < threshold)
     {
-        MergeSortPoolInternal(begin, mid, pool, comp);
-        MergeSortPoolInternal(mid, end, pool, comp);
+        MergeSortPoolInternal(begin, mid, pool, comp, bufferIt, !toBuffer);
+        MergeSortPoolInternal(mid, end, pool, comp, bufferIt + length / 2, !toBuffer);
     } 
     else 
     {
-        auto leftLambda = [begin, mid, &pool, comp]()
+        TRACE_SPAN_ARG("MergeSort::Recurse", length);
+
+        auto leftLambda = [begin, mid, &pool, comp, bufferIt, toBuffer]()
         {
-            MergeSortPoolInternal(begin, mid, pool, comp);
+            MergeSortPoolInternal(begin, mid, pool, comp, bufferIt, !toBuffer);
         };
         auto future = pool.Enqueue(leftLambda);
-        MergeSortPoolInternal(mid, end, pool, comp);
+        MergeSortPoolInternal(mid, end, pool, comp, bufferIt + length / 2, !toBuffer);
 
-        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
-        {
-            if (!pool.TryExecuteTask())
-            {
-                std::this_thread::yield();
-            }
-        }
+        pool.WaitFor(future);
+        future.get();
     }
     
-    std::inplace_merge(begin, mid, end, comp);
+    TRACE_SPAN_ARG_IF(static_cast<std::size_t>(length) >= threshold, "MergeSort::Merge", length);
+    MergeSortedHalves(begin, end, bufferIt, toBuffer, [&pool, comp, length](auto first, auto middle, auto last, auto out)
+    {
+        ParallelMerge(first, middle, last, out, comp, GetMergeParts(length, pool.Size()),
+            [&pool](std::size_t parts, auto func)
+            {
+                RunPartsPool(pool, parts, func);
+            });
+    });
 }
 
-template<typename Iter, typename Comp, typename Cont>
-void MergeSortInternalWithBuffer(Iter begin, Iter end, Comp comp, Cont& buffer) 
+template<typename Iter, typename Comp, typename BufferIt>
+void MergeSortInternalWithBuffer(Iter begin, Iter end, Comp comp, BufferIt bufferIt, bool toBuffer) 
 {
-    auto length = std::distance(begin, end);
-    if (length <= 1) 
+    if (SortLeaf(begin, end, bufferIt, toBuffer, comp))
     {
         return;
     }
-    
+
+    auto length = std::distance(begin, end);
     Iter mid = begin + length / 2;
     
-    MergeSortInternalWithBuffer(begin, mid, comp, buffer);
-    MergeSortInternalWithBuffer(mid, end, comp, buffer);
+    MergeSortInternalWithBuffer(begin, mid, comp, bufferIt, !toBuffer);
+    MergeSortInternalWithBuffer(mid, end, comp, bufferIt + length / 2, !toBuffer);
     
-    std::merge(begin, mid, mid, end, buffer.begin(), comp);
-    std::copy(buffer.begin(), buffer.begin() + length, begin);
+    MergeSortedHalves(begin, end, bufferIt, toBuffer, [comp](auto first, auto middle, auto last, auto out)
+    {
+        MoveMerge(first, middle, middle, last, out, comp);
+    });
 }
 
+// Every split above threshold runs one half on a new thread, while merges only split into as many parts
+// as mergeThreads, which halves per level since sibling merges run at the same time
 template<typename Iter, typename Comp, typename BufferIt>
-void ParallelMergeSortInternalWithBuffer(Iter begin, Iter end, Comp comp, BufferIt bufferIt) 
+void ParallelMergeSortInternalWithBuffer(Iter begin, Iter end, Comp comp, BufferIt bufferIt, bool toBuffer,
+    std::size_t mergeThreads) 
 {
-    auto length = std::distance(begin, end);
-    if (length <= 1) 
+    if (SortLeaf(begin, end, bufferIt, toBuffer, comp))
     {
         return;
     }
-    
+
+    auto length = std::distance(begin, end);
     Iter mid = begin + length / 2;
     
     if (length < threshold)
     {
-        ParallelMergeSortInternalWithBuffer(begin, mid, comp, bufferIt);
-        ParallelMergeSortInternalWithBuffer(mid, end, comp, bufferIt + length / 2);
+        ParallelMergeSortInternalWithBuffer(begin, mid, comp, bufferIt, !toBuffer, 0);
+        ParallelMergeSortInternalWithBuffer(mid, end, comp, bufferIt + length / 2, !toBuffer, 0);
     }
     else
     {
-        auto future = std::async(
-            ParallelMergeSortInternalWithBuffer<Iter, Comp, BufferIt>, mid, end, comp, bufferIt + length / 2);
+        TRACE_SPAN_ARG("MergeSort::Recurse", length);
+
+        std::size_t leftMergeThreads = mergeThreads / 2;
+        auto future = std::async(ParallelMergeSortInternalWithBuffer<Iter, Comp, BufferIt>, mid, end, comp,
+            bufferIt + length / 2, !toBuffer, mergeThreads - leftMergeThreads);
         
-        ParallelMergeSortInternalWithBuffer(begin, mid, comp, bufferIt);
+        ParallelMergeSortInternalWithBuffer(begin, mid, comp, bufferIt, !toBuffer, leftMergeThreads);
         future.wait();
     }
     
-    std::merge(begin, mid, mid, end, bufferIt, comp);
-    std::copy(bufferIt, bufferIt + length, begin);
+    TRACE_SPAN_ARG_IF(static_cast<std::size_t>(length) >= threshold, "MergeSort::Merge", length);
+    MergeSortedHalves(begin, end, bufferIt, toBuffer, [comp, length, mergeThreads](auto first, auto middle, auto last, auto out)
+    {
+        ParallelMerge(first, middle, last, out, comp, GetMergeParts(length, mergeThreads),
+            [](std::size_t parts, auto func)
+            {
+                RunPartsAsync(parts, func);
+            });
+    });
 }
 
 template<typename Iter, typename Comp, typename BufferIt>
-void ParallelMergeSortInternalWithBufferCountThreads(Iter begin, Iter end, Comp comp, BufferIt bufferIt, std::size_t threadsAvailable) 
+void ParallelMergeSortInternalWithBufferCountThreads(Iter begin, Iter end, Comp comp, BufferIt bufferIt, bool toBuffer,
+    std::size_t threadsAvailable) 
 {
-    auto length = std::distance(begin, end);
-    if (length <= 1) 
+    if (SortLeaf(begin, end, bufferIt, toBuffer, comp))
     {
         return;
     }
-    
+
+    auto length = std::distance(begin, end);
     Iter mid = begin + length / 2;
     
     if (length < threshold)
     {
-        ParallelMergeSortInternalWithBufferCountThreads(begin, mid, comp, bufferIt, 0);
-        ParallelMergeSortInternalWithBufferCountThreads(mid, end, comp, bufferIt + length / 2, 0);
+        ParallelMergeSortInternalWithBufferCountThreads(begin, mid, comp, bufferIt, !toBuffer, 0);
+        ParallelMergeSortInternalWithBufferCountThreads(mid, end, comp, bufferIt + length / 2, !toBuffer, 0);
     }
     else
     {
+        TRACE_SPAN_ARG("MergeSort::Recurse", length);
+
         std::size_t leftAvailableThreads = threadsAvailable / 2;
         auto future = std::async(
             ParallelMergeSortInternalWithBufferCountThreads<Iter, Comp, BufferIt>, mid, end, 
-            comp, bufferIt + length / 2, threadsAvailable - leftAvailableThreads);
+            comp, bufferIt + length / 2, !toBuffer, threadsAvailable - leftAvailableThreads);
         
-        ParallelMergeSortInternalWithBufferCountThreads(begin, mid, comp, bufferIt, leftAvailableThreads);
+        ParallelMergeSortInternalWithBufferCountThreads(begin, mid, comp, bufferIt, !toBuffer, leftAvailableThreads);
         future.wait();
     }
     
-    std::merge(begin, mid, mid, end, bufferIt, comp);
-    std::copy(bufferIt, bufferIt + length, begin);
+    TRACE_SPAN_ARG_IF(static_cast<std::size_t>(length) >= threshold, "MergeSort::Merge", length);
+    MergeSortedHalves(begin, end, bufferIt, toBuffer, [comp, length, threadsAvailable](auto first, auto middle, auto last, auto out)
+    {
+        ParallelMerge(first, middle, last, out, comp, GetMergeParts(length, threadsAvailable),
+            [](std::size_t parts, auto func)
+            {
+                RunPartsAsync(parts, func);
+            });
+    });
+}
+
+// Buffered sorts start with the elements moved into the buffer and merge them back into the
+// range on the way up, so the value type only has to be move constructible
+template<typename Iter>
+auto MoveToBuffer(Iter begin, Iter end)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+    return std::vector<Value>(std::make_move_iterator(begin), std::make_move_iterator(end));
 }
 
 template<typename Iter, typename Comp = std::less<>>
@@ -172,35 +430,31 @@ void ParallelMergeSort(Iter begin, Iter end, Comp comp = {})
 template<typename Iter, typename Comp = std::less<>>
 void ParallelMergeSortWithBuffer(Iter begin, Iter end, Comp comp = {}) 
 {
-    auto length = std::distance(begin, end);
-    using Value = typename std::iterator_traits<Iter>::value_type;
-    std::vector<Value> buffer(length);
+    auto buffer = MoveToBuffer(begin, end);
 
-    ParallelMergeSortInternalWithBuffer(begin, end, comp, buffer.begin());
+    ParallelMergeSortInternalWithBuffer(buffer.begin(), buffer.end(), comp, begin, true, std::thread::hardware_concurrency());
 }
 
 template<typename Iter, typename Comp = std::less<>>
 void ParallelMergeSortWithBufferCountThreads(Iter begin, Iter end, Comp comp = {}) 
 {
-    auto length = std::distance(begin, end);
-    using Value = typename std::iterator_traits<Iter>::value_type;
-    std::vector<Value> buffer(length);
+    auto buffer = MoveToBuffer(begin, end);
 
-    ParallelMergeSortInternalWithBufferCountThreads(begin, end, comp, buffer.begin(), std::thread::hardware_concurrency());
+    ParallelMergeSortInternalWithBufferCountThreads(buffer.begin(), buffer.end(), comp, begin, true, std::thread::hardware_concurrency());
 }
 
 template<typename Iter, typename Comp = std::less<>>
 void MergeSort(Iter begin, Iter end, Comp comp = {})
 {
-    auto length = std::distance(begin, end);
-    using Value = typename std::iterator_traits<Iter>::value_type;
-    std::vector<Value> buffer(length);
+    auto buffer = MoveToBuffer(begin, end);
 
-    MergeSortInternalWithBuffer(begin, end, comp, buffer);
+    MergeSortInternalWithBuffer(buffer.begin(), buffer.end(), comp, begin, true);
 }
 
 template<typename Iter, typename ThreadPool, typename Comp = std::less<>>
 void ParallelMergeSortThreadPool(Iter begin, Iter end, ThreadPool& pool, Comp comp = {}) 
 {
-    MergeSortPoolInternal(begin, end, pool, comp);
+    auto buffer = MoveToBuffer(begin, end);
+
+    MergeSortPoolInternal(buffer.begin(), buffer.end(), pool, comp, begin, true);
 }
\ No newline at end of file
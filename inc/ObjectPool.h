@@ -0,0 +1,276 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+#include "CountedPtr.h"
+
+// Fixed size block pool. Every thread caches two magazines (arrays of free blocks),
+// so most allocations and deallocations don't touch shared memory at all. Full
+// and empty magazines are exchanged with a lock-free depot
+template<std::size_t BlockSize, std::size_t BlockAlignment = alignof(std::max_align_t)>
+class ObjectPool
+{
+public:
+    static constexpr std::size_t magazineSize = 64u;
+    static constexpr std::size_t blockSize = (BlockSize + BlockAlignment - 1) / BlockAlignment * BlockAlignment;
+
+    static void* Allocate()
+    {
+        return GetThreadCache().Allocate();
+    }
+
+    static void Deallocate(void* ptr)
+    {
+        GetThreadCache().Deallocate(ptr);
+    }
+
+    ~ObjectPool()
+    {
+        for (void* slab : slabs)
+        {
+            ::operator delete(slab, std::align_val_t{ BlockAlignment });
+        }
+    }
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool(ObjectPool&&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+    ObjectPool& operator=(ObjectPool&&) = delete;
+
+private:
+    struct Magazine
+    {
+        std::array<void*, magazineSize> blocks;
+        std::size_t count = 0;
+        std::atomic<Magazine*> next = nullptr;
+    };
+
+    // Magazines are never freed while the pool is alive, so reading next of an already
+    // popped magazine is safe, the count of CountedPtr is used as an ABA tag
+    class MagazineStack
+    {
+    public:
+        void Push(Magazine* magazine)
+        {
+            CountedPtr<Magazine> old = head.load(std::memory_order_relaxed);
+            CountedPtr<Magazine> newHead;
+
+            do
+            {
+                magazine->next.store(old.ptr, std::memory_order_relaxed);
+                newHead = { magazine, old.count + 1 };
+            }
+            while (!head.compare_exchange_weak(old, newHead, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        Magazine* Pop()
+        {
+            CountedPtr<Magazine> old = head.load(std::memory_order_acquire);
+            CountedPtr<Magazine> newHead;
+
+            do
+            {
+                if (!old.ptr)
+                {
+                    return nullptr;
+                }
+
+                newHead = { old->next.load(std::memory_order_relaxed), old.count + 1 };
+            }
+            while (!head.compare_exchange_weak(old, newHead, std::memory_order_acquire, std::memory_order_acquire));
+
+            return old.ptr;
+        }
+
+    private:
+        std::atomic<CountedPtr<Magazine>> head = CountedPtr<Magazine>{ nullptr, 0 };
+    };
+
+    class ThreadCache
+    {
+    public:
+        explicit ThreadCache(ObjectPool& pool) :
+            pool(pool),
+            loaded(pool.GetEmptyMagazine()),
+            previous(pool.GetEmptyMagazine())
+        { }
+
+        ~ThreadCache()
+        {
+            pool.ReturnMagazine(loaded);
+            pool.ReturnMagazine(previous);
+        }
+
+        void* Allocate()
+        {
+            if (loaded->count == 0)
+            {
+                if (previous->count > 0)
+                {
+                    std::swap(loaded, previous);
+                }
+                else
+                {
+                    pool.emptyMagazines.Push(previous);
+                    previous = loaded;
+                    loaded = pool.GetFullMagazine();
+                }
+            }
+
+            return loaded->blocks[--loaded->count];
+        }
+
+        void Deallocate(void* ptr)
+        {
+            if (loaded->count == magazineSize)
+            {
+                if (previous->count < magazineSize)
+                {
+                    std::swap(loaded, previous);
+                }
+                else
+                {
+                    pool.fullMagazines.Push(previous);
+                    previous = loaded;
+                    loaded = pool.GetEmptyMagazine();
+                }
+            }
+
+            loaded->blocks[loaded->count++] = ptr;
+        }
+
+        ThreadCache(const ThreadCache&) = delete;
+        ThreadCache(ThreadCache&&) = delete;
+        ThreadCache& operator=(const ThreadCache&) = delete;
+        ThreadCache& operator=(ThreadCache&&) = delete;
+
+    private:
+        ObjectPool& pool;
+        Magazine* loaded;
+        Magazine* previous;
+    };
+
+    ObjectPool() = default;
+
+    static ObjectPool& GetInstance()
+    {
+        static ObjectPool pool;
+        return pool;
+    }
+
+    // Thread local objects of a thread are destroyed before the static pool,
+    // so the cache can always return its magazines
+    static ThreadCache& GetThreadCache()
+    {
+        thread_local ThreadCache cache(GetInstance());
+        return cache;
+    }
+
+    Magazine* GetEmptyMagazine()
+    {
+        if (Magazine* magazine = emptyMagazines.Pop())
+        {
+            return magazine;
+        }
+
+        std::scoped_lock lock(mutex);
+        return magazines.emplace_back(std::make_unique<Magazine>()).get();
+    }
+
+    Magazine* GetFullMagazine()
+    {
+        if (Magazine* magazine = fullMagazines.Pop())
+        {
+            return magazine;
+        }
+
+        Magazine* magazine = GetEmptyMagazine();
+        auto* slab = static_cast<std::byte*>(::operator new(blockSize * magazineSize, std::align_val_t{ BlockAlignment }));
+
+        {
+            std::scoped_lock lock(mutex);
+            slabs.push_back(slab);
+        }
+
+        for (std::size_t i = 0; i < magazineSize; i++)
+        {
+            magazine->blocks[i] = slab + i * blockSize;
+        }
+        magazine->count = magazineSize;
+
+        return magazine;
+    }
+
+    void ReturnMagazine(Magazine* magazine)
+    {
+        if (magazine->count > 0)
+        {
+            fullMagazines.Push(magazine);
+        }
+        else
+        {
+            emptyMagazines.Push(magazine);
+        }
+    }
+
+    MagazineStack fullMagazines;
+    MagazineStack emptyMagazines;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Magazine>> magazines;
+    std::vector<void*> slabs;
+};
+
+// Stateless allocator on top of ObjectPool, single object allocations (container nodes)
+// go to the pool of matching size, arrays are forwarded to std::allocator
+template<typename T>
+struct PoolAllocator
+{
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept
+    { }
+
+    T* allocate(std::size_t n)
+    {
+        if (n == 1)
+        {
+            return static_cast<T*>(ObjectPool<sizeof(T), alignof(T)>::Allocate());
+        }
+
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* ptr, std::size_t n)
+    {
+        if (n == 1)
+        {
+            ObjectPool<sizeof(T), alignof(T)>::Deallocate(ptr);
+            return;
+        }
+
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept
+    {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept
+    {
+        return false;
+    }
+};
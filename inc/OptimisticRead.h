@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Version counter for optimistic readers, writers have to be serialized by a lock already.
+// The version is odd while a write is in progress, a read is valid only if it observed
+// the same even version before and after reading the data.
+// There are no fences: readers load the data with OptimisticLoad, whose acquire loads keep the
+// second version load after them, and writers store it with OptimisticStore, whose release stores
+// make a reader that sees any of them also see the odd version
+class SeqLock
+{
+public:
+    class WriteScope
+    {
+    public:
+        explicit WriteScope(SeqLock& seqLock) :
+            seqLock(seqLock)
+        {
+            seqLock.WriteBegin();
+        }
+
+        ~WriteScope()
+        {
+            seqLock.WriteEnd();
+        }
+
+        WriteScope(const WriteScope&) = delete;
+        WriteScope(WriteScope&&) = delete;
+        WriteScope& operator=(const WriteScope&) = delete;
+        WriteScope& operator=(WriteScope&&) = delete;
+
+    private:
+        SeqLock& seqLock;
+    };
+
+    std::uint64_t ReadBegin() const
+    {
+        return version.load(std::memory_order_acquire);
+    }
+
+    bool ReadValidate(std::uint64_t before) const
+    {
+        return (before & 1u) == 0 && version.load(std::memory_order_relaxed) == before;
+    }
+
+    void WriteBegin()
+    {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void WriteEnd()
+    {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::atomic<std::uint64_t> version = 0;
+};
+
+namespace OptimisticAccess
+{
+    // Widest lock free word every object of T is aligned to
+    template<typename T>
+    using Word = std::conditional_t<alignof(T) % 8 == 0, std::uint64_t,
+        std::conditional_t<alignof(T) % 4 == 0, std::uint32_t,
+        std::conditional_t<alignof(T) % 2 == 0, std::uint16_t, std::uint8_t>>>;
+
+    template<typename T>
+    const std::atomic<Word<T>>* AsWords(const T& object)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable objects can be copied by words");
+        static_assert(sizeof(std::atomic<Word<T>>) == sizeof(Word<T>) && std::atomic<Word<T>>::is_always_lock_free,
+            "Atomic words have to be plain lock free words");
+
+        return reinterpret_cast<const std::atomic<Word<T>>*>(&object);
+    }
+}
+
+// Copies data a concurrent writer may be storing to. Every word is loaded atomically, so a racing
+// copy is torn rather than undefined, and the caller discards it when the version changed
+template<typename T>
+T OptimisticLoad(const T& source)
+{
+    using Word = OptimisticAccess::Word<T>;
+
+    const std::atomic<Word>* words = OptimisticAccess::AsWords(source);
+    alignas(T) unsigned char copy[sizeof(T)];
+
+    for (std::size_t i = 0; i < sizeof(T) / sizeof(Word); i++)
+    {
+        Word word = words[i].load(std::memory_order_acquire);
+        std::memcpy(copy + i * sizeof(Word), &word, sizeof(Word));
+    }
+
+    return *std::launder(reinterpret_cast<const T*>(copy));
+}
+
+// Writer side of OptimisticLoad, the destination doesn't have to hold an object yet
+template<typename T>
+void OptimisticStore(T& destination, const T& value)
+{
+    using Word = OptimisticAccess::Word<T>;
+
+    std::atomic<Word>* words = const_cast<std::atomic<Word>*>(OptimisticAccess::AsWords(destination));
+    const unsigned char* source = reinterpret_cast<const unsigned char*>(&value);
+
+    for (std::size_t i = 0; i < sizeof(T) / sizeof(Word); i++)
+    {
+        Word word;
+        std::memcpy(&word, source + i * sizeof(Word), sizeof(Word));
+        words[i].store(word, std::memory_order_release);
+    }
+}
+
+// Pairs aren't trivially copyable because of their assignment operators, so the members are stored one by one
+template<typename First, typename Second>
+void OptimisticStore(std::pair<First, Second>& destination, const std::pair<First, Second>& value)
+{
+    OptimisticStore(destination.first, value.first);
+    OptimisticStore(destination.second, value.second);
+}
+
+enum class OptimisticReadResult
+{
+    Found,
+    Absent,
+    Retry
+};
+
+// Optimistic readers copy keys and values that may be concurrently overwritten, which is only
+// possible word by word for trivially copyable types. Tables reading optimistically never free memory a reader
+// could still reach: erased entries are recycled and replaced arrays are kept until destruction.
+// Can be specialized to opt out, e.g. when a key comparison dereferences pointers
+template<typename Key, typename Value>
+struct AllowOptimisticReads :
+    std::bool_constant<std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>>
+{ };
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "ThreadPool.h"
+#include "MergeSort.h"
+
+// Below this many elements per thread the standard algorithms are used alone
+inline constexpr std::size_t partialSortMinPartLength = std::size_t(1) << 16;
+// A chunk keeps its smallest elements in a bounded heap while they are at most this fraction of it
+inline constexpr std::size_t partialSortHeapRatio = 64;
+inline constexpr std::size_t nthElementSampleLength = std::size_t(1) << 14;
+// Distance in sample ranks of both splitters from the wanted rank, four standard deviations
+inline constexpr std::size_t nthElementSampleMargin = 256;
+
+// Moves the element of rank nth - begin to nth, smaller or equal ones before it and greater or
+// equal ones after it, like std::nth_element. Two splitters from a sorted random sample bracket
+// the wanted rank, one parallel pass distributes elements below, between and above them, and
+// only the few elements between the splitters are left for a sequential selection
+template<typename Iter, typename ThreadPool, typename Comp = std::less<>>
+void ParallelNthElement(Iter begin, Iter nth, Iter end, ThreadPool& pool, Comp comp = {})
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
+    std::size_t length = std::distance(begin, end);
+    std::size_t parts = std::min(length / partialSortMinPartLength, pool.Size() + 1);
+
+    if (nth == end)
+    {
+        return;
+    }
+
+    if (parts <= 1)
+    {
+        std::nth_element(begin, nth, end, comp);
+        return;
+    }
+
+    std::size_t rank = std::distance(begin, nth);
+
+    std::minstd_rand generator(static_cast<std::minstd_rand::result_type>(length));
+    std::uniform_int_distribution<std::size_t> distribution(0, length - 1);
+
+    // The sample holds positions, so values are neither copied nor moved until they are distributed
+    std::vector<std::size_t> sample(nthElementSampleLength);
+
+    for (std::size_t& position : sample)
+    {
+        position = distribution(generator);
+    }
+
+    std::sort(sample.begin(), sample.end(), [&](std::size_t left, std::size_t right)
+    {
+        return comp(begin[left], begin[right]);
+    });
+
+    std::size_t sampleRank = rank * nthElementSampleLength / length;
+    const Value& low = begin[sample[sampleRank > nthElementSampleMargin ? sampleRank - nthElementSampleMargin : 0]];
+    const Value& high = begin[sample[std::min(sampleRank + nthElementSampleMargin, nthElementSampleLength - 1)]];
+
+    // Bucket 0 holds elements below low, bucket 2 elements above high, bucket 1 the rest
+    std::vector<std::uint8_t> bucketOf(length);
+    std::vector<std::array<std::size_t, 3>> offsets(parts);
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        std::array<std::size_t, 3>& counts = offsets[part];
+        counts.fill(0);
+
+        for (std::size_t i = length * part / parts; i < length * (part + 1) / parts; i++)
+        {
+            bucketOf[i] = comp(begin[i], low) ? 0 : comp(high, begin[i]) ? 2 : 1;
+            counts[bucketOf[i]]++;
+        }
+    });
+
+    std::array<std::size_t, 4> bucketBegins;
+    std::size_t offset = 0;
+
+    for (std::size_t bucket = 0; bucket < 3; bucket++)
+    {
+        bucketBegins[bucket] = offset;
+
+        for (std::size_t part = 0; part < parts; part++)
+        {
+            std::size_t count = offsets[part][bucket];
+            offsets[part][bucket] = offset;
+            offset += count;
+        }
+    }
+
+    bucketBegins[3] = length;
+
+    {
+        auto buffer = MoveToBuffer(begin, end);
+
+        RunPartsPool(pool, parts, [&](std::size_t part)
+        {
+            std::array<std::size_t, 3>& destinations = offsets[part];
+
+            for (std::size_t i = length * part / parts; i < length * (part + 1) / parts; i++)
+            {
+                begin[destinations[bucketOf[i]]++] = std::move(buffer[i]);
+            }
+        });
+    }
+
+    // Rarely the sample misses and the wanted rank lies in an outer bucket, which is always
+    // smaller than the range because it doesn't hold the splitters
+    if (rank < bucketBegins[1])
+    {
+        ParallelNthElement(begin, nth, begin + bucketBegins[1], pool, comp);
+    }
+    else if (rank < bucketBegins[2])
+    {
+        std::nth_element(begin + bucketBegins[1], nth, begin + bucketBegins[2], comp);
+    }
+    else
+    {
+        ParallelNthElement(begin + bucketBegins[2], nth, end, pool, comp);
+    }
+}
+
+// Sorts the middle - begin smallest elements into [begin, middle), the order of the rest is
+// unspecified, like std::partial_sort. For few elements every thread keeps the smallest ones of
+// its chunk by a bounded heap or a selection, and only these candidates are compared further.
+// More elements are selected by ParallelNthElement and sorted by ParallelMergeSortThreadPool
+template<typename Iter, typename ThreadPool, typename Comp = std::less<>>
+void ParallelPartialSort(Iter begin, Iter middle, Iter end, ThreadPool& pool, Comp comp = {})
+{
+    std::size_t length = std::distance(begin, end);
+    std::size_t count = std::distance(begin, middle);
+    std::size_t parts = std::min(length / partialSortMinPartLength, pool.Size() + 1);
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (parts <= 1)
+    {
+        std::partial_sort(begin, middle, end, comp);
+        return;
+    }
+
+    // Candidates of every chunk have to fit between the chunk and the candidates before it
+    if (count > length / parts / 2)
+    {
+        ParallelNthElement(begin, middle, end, pool, comp);
+        ParallelMergeSortThreadPool(begin, middle, pool, comp);
+        return;
+    }
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        Iter first = begin + length * part / parts;
+        Iter last = begin + length * (part + 1) / parts;
+
+        if (count * partialSortHeapRatio <= static_cast<std::size_t>(std::distance(first, last)))
+        {
+            std::partial_sort(first, first + count, last, comp);
+        }
+        else
+        {
+            std::nth_element(first, first + count, last, comp);
+        }
+    });
+
+    for (std::size_t part = 1; part < parts; part++)
+    {
+        Iter first = begin + length * part / parts;
+        std::swap_ranges(first, first + count, begin + part * count);
+    }
+
+    std::partial_sort(begin, middle, begin + parts * count, comp);
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <exception>
+#include <utility>
+#include <cstddef>
+
+#include "TraceSpans.h"
+
+enum class StageMode
+{
+    // One token at a time, in the order the source produced them
+    SerialInOrder,
+    // One token at a time, in any order
+    SerialOutOfOrder,
+    // Any amount of tokens at once
+    Parallel
+};
+
+// Streaming pipeline of stages over a bounded set of tokens. Run creates maxTokens tokens, the
+// source fills one at a time until it returns false and every stage then processes it in place,
+// so tokens are never copied or moved and a token that reached the end goes back to the source
+// with its buffers intact. At most maxTokens items are in flight, a fast source can't run ahead.
+// A worker carries its token through the stages as far as it can, a token that finds a serial
+// stage busy waits there without blocking the worker, and the worker that leaves the stage
+// enqueues it to its own queue
+template<typename Token>
+class Pipeline
+{
+public:
+    // The source is called serially, returning false ends the stream
+    explicit Pipeline(std::function<bool(Token&)> source)
+    {
+        stages.push_back({ StageMode::SerialOutOfOrder, std::move(source) });
+    }
+
+    Pipeline& AddStage(StageMode mode, std::function<void(Token&)> func)
+    {
+        stages.push_back({ mode, [func = std::move(func)](Token& token)
+        {
+            func(token);
+            return true;
+        } });
+
+        return *this;
+    }
+
+    // Returns once the source is exhausted and every produced token passed every stage.
+    // The first exception of a stage stops the source and is rethrown here, tokens already in
+    // flight still pass the serial stages but skip the stage functions
+    template<typename ThreadPool>
+    void Run(ThreadPool& pool, std::size_t maxTokens)
+    {
+        if (maxTokens == 0)
+        {
+            return;
+        }
+
+        auto state = std::make_shared<RunState>(maxTokens, stages.size());
+        std::future<void> done = state->done.get_future();
+
+        for (std::size_t token = 0; token < maxTokens; token++)
+        {
+            pool.Enqueue([this, &pool, state, token]()
+            {
+                Process(pool, state, token, 0, false);
+            });
+        }
+
+        pool.WaitFor(done);
+
+        if (state->exception)
+        {
+            std::rethrow_exception(state->exception);
+        }
+    }
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline(Pipeline&&) = delete;
+
+    Pipeline& operator=(const Pipeline&) = delete;
+    Pipeline& operator=(Pipeline&&) = delete;
+
+private:
+    struct Stage
+    {
+        StageMode mode;
+        std::function<bool(Token&)> func;
+    };
+
+    struct StageState
+    {
+        std::mutex mutex;
+        bool busy = false;
+        // Next sequence number of a SerialInOrder stage
+        std::size_t sequence = 0;
+        // Tokens waiting for a SerialInOrder stage by sequence number modulo the amount of tokens.
+        // Waiting sequence numbers are less than the amount of tokens apart, so they can't collide
+        std::vector<std::ptrdiff_t> ordered;
+        // Tokens waiting for a SerialOutOfOrder stage
+        std::deque<std::size_t> waiting;
+    };
+
+    struct RunState
+    {
+        RunState(std::size_t maxTokens, std::size_t amountOfStages) :
+            tokens(maxTokens),
+            sequences(maxTokens),
+            stageStates(amountOfStages)
+        {
+            for (StageState& stageState : stageStates)
+            {
+                stageState.ordered.assign(maxTokens, -1);
+            }
+        }
+
+        std::vector<Token> tokens;
+        std::vector<std::size_t> sequences;
+        std::vector<StageState> stageStates;
+
+        // Only touched by the holder of the source stage
+        std::size_t nextSequence = 0;
+        bool exhausted = false;
+
+        std::atomic<std::size_t> retired{ 0 };
+        std::atomic<bool> cancelled{ false };
+        std::mutex exceptionMutex;
+        std::exception_ptr exception;
+        std::promise<void> done;
+    };
+
+    template<typename ThreadPool>
+    void Process(ThreadPool& pool, const std::shared_ptr<RunState>& state, std::size_t token, std::size_t stage, bool acquired) const
+    {
+        while (true)
+        {
+            bool serial = stages[stage].mode != StageMode::Parallel;
+
+            if (serial && !acquired && !Acquire(*state, token, stage))
+            {
+                return;
+            }
+
+            bool produced = RunStage(*state, token, stage);
+
+            if (serial)
+            {
+                Release(pool, state, stage);
+            }
+
+            // Retiring is the last access of a token to the state, after the last one Run may return
+            if (!produced)
+            {
+                if (state->retired.fetch_add(1, std::memory_order_acq_rel) + 1 == state->tokens.size())
+                {
+                    state->done.set_value();
+                }
+
+                return;
+            }
+
+            stage = (stage + 1) % stages.size();
+            acquired = false;
+        }
+    }
+
+    // Either takes the serial stage for the token or leaves the token waiting for it
+    bool Acquire(RunState& state, std::size_t token, std::size_t stage) const
+    {
+        StageState& stageState = state.stageStates[stage];
+        std::scoped_lock lock(stageState.mutex);
+
+        if (stages[stage].mode == StageMode::SerialInOrder)
+        {
+            std::size_t sequence = state.sequences[token];
+
+            if (!stageState.busy && sequence == stageState.sequence)
+            {
+                stageState.busy = true;
+                return true;
+            }
+
+            stageState.ordered[sequence % state.tokens.size()] = static_cast<std::ptrdiff_t>(token);
+            return false;
+        }
+
+        if (!stageState.busy)
+        {
+            stageState.busy = true;
+            return true;
+        }
+
+        stageState.waiting.push_back(token);
+        return false;
+    }
+
+    // Hands the serial stage to the next waiting token, which continues as a task of this worker
+    template<typename ThreadPool>
+    void Release(ThreadPool& pool, const std::shared_ptr<RunState>& state, std::size_t stage) const
+    {
+        StageState& stageState = state->stageStates[stage];
+        std::ptrdiff_t next = -1;
+
+        {
+            std::scoped_lock lock(stageState.mutex);
+
+            if (stages[stage].mode == StageMode::SerialInOrder)
+            {
+                stageState.sequence++;
+                std::swap(next, stageState.ordered[stageState.sequence % state->tokens.size()]);
+            }
+            else if (!stageState.waiting.empty())
+            {
+                next = static_cast<std::ptrdiff_t>(stageState.waiting.front());
+                stageState.waiting.pop_front();
+            }
+
+            stageState.busy = next >= 0;
+        }
+
+        if (next >= 0)
+        {
+            pool.Enqueue([this, &pool, state, token = static_cast<std::size_t>(next), stage]()
+            {
+                Process(pool, state, token, stage, true);
+            });
+        }
+    }
+
+    // Returns false if the source had no more tokens
+    bool RunStage(RunState& state, std::size_t token, std::size_t stage) const
+    {
+        if (stage == 0 && (state.exhausted || state.cancelled.load(std::memory_order_relaxed)))
+        {
+            state.exhausted = true;
+            return false;
+        }
+
+        // Tokens still pass the stage, so SerialInOrder stages see every sequence number
+        if (state.cancelled.load(std::memory_order_relaxed))
+        {
+            return true;
+        }
+
+        TRACE_SPAN_ARG("Pipeline::Stage", stage);
+
+        try
+        {
+            if (!stages[stage].func(state.tokens[token]))
+            {
+                state.exhausted = true;
+                return false;
+            }
+
+            if (stage == 0)
+            {
+                state.sequences[token] = state.nextSequence++;
+            }
+        }
+        catch (...)
+        {
+            {
+                std::scoped_lock lock(state.exceptionMutex);
+
+                if (!state.exception)
+                {
+                    state.exception = std::current_exception();
+                }
+            }
+
+            state.cancelled.store(true, std::memory_order_relaxed);
+
+            if (stage == 0)
+            {
+                state.exhausted = true;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::vector<Stage> stages;
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "ThreadPool.h"
+#include "MergeSort.h"
+
+inline constexpr std::size_t radixBits = 8;
+inline constexpr std::size_t radixBuckets = std::size_t(1) << radixBits;
+// Smaller parts cost more in histograms and synchronization than they gain
+inline constexpr std::size_t radixMinPartLength = std::size_t(1) << 16;
+
+// Maps a key to an unsigned integer with the same order: signed integers get the sign bit
+// flipped, negative floats get all bits flipped and positive ones only the sign bit
+template<typename Key>
+auto ToRadixKey(Key key)
+{
+    if constexpr (std::is_floating_point_v<Key>)
+    {
+        static_assert(sizeof(Key) == 4 || sizeof(Key) == 8, "Only 32 and 64 bit floating point keys are supported");
+
+        using Bits = std::conditional_t<sizeof(Key) == 4, std::uint32_t, std::uint64_t>;
+        constexpr Bits signBit = Bits(1) << (sizeof(Bits) * 8 - 1);
+
+        Bits bits;
+        std::memcpy(&bits, &key, sizeof(bits));
+
+        return (bits & signBit) ? static_cast<Bits>(~bits) : static_cast<Bits>(bits | signBit);
+    }
+    else
+    {
+        static_assert(std::is_integral_v<Key> && !std::is_same_v<Key, bool>, "Keys have to be integers or floats");
+
+        using Bits = std::make_unsigned_t<Key>;
+        constexpr Bits signBit = std::is_signed_v<Key> ? Bits(1) << (sizeof(Bits) * 8 - 1) : Bits(0);
+
+        return static_cast<Bits>(static_cast<Bits>(key) ^ signBit);
+    }
+}
+
+// Uninitialized storage for the elements of a radix sort, they are move constructed into it
+// by the first pass that writes it
+template<typename Value>
+class RadixBuffer
+{
+public:
+    explicit RadixBuffer(std::size_t length) :
+        length(length),
+        data(std::allocator<Value>().allocate(length))
+    { }
+
+    ~RadixBuffer()
+    {
+        if (constructed)
+        {
+            std::destroy_n(data, length);
+        }
+
+        std::allocator<Value>().deallocate(data, length);
+    }
+
+    RadixBuffer(const RadixBuffer&) = delete;
+    RadixBuffer(RadixBuffer&&) = delete;
+    RadixBuffer& operator=(const RadixBuffer&) = delete;
+    RadixBuffer& operator=(RadixBuffer&&) = delete;
+
+    Value* Data() const
+    {
+        return data;
+    }
+
+    bool constructed = false;
+
+private:
+    std::size_t length;
+    Value* data;
+};
+
+// Moves a part to its digit offsets, move constructing the elements if the destination is
+// uninitialized. Small trivial types go through a cache line per digit first (software write
+// combining), so the destination is written a whole line at a time instead of touching
+// radixBuckets scattered lines for every few elements
+template<typename SourceIt, typename DestIt, typename GetDigit>
+void RadixScatterPart(SourceIt first, SourceIt last, DestIt destination,
+    std::array<std::size_t, radixBuckets>& offsets, GetDigit& getDigit, bool construct)
+{
+    using Value = typename std::iterator_traits<SourceIt>::value_type;
+
+    if constexpr (std::is_trivial_v<Value> && sizeof(Value) <= 16)
+    {
+        constexpr std::size_t lineLength = 64 / sizeof(Value);
+
+        std::vector<Value> lines(radixBuckets * lineLength);
+        std::array<std::size_t, radixBuckets> filled{};
+
+        for (; first != last; ++first)
+        {
+            std::size_t digit = getDigit(*first);
+            auto line = lines.begin() + digit * lineLength;
+
+            line[filled[digit]] = *first;
+
+            if (++filled[digit] == lineLength)
+            {
+                std::copy(line, line + lineLength, destination + offsets[digit]);
+                offsets[digit] += lineLength;
+                filled[digit] = 0;
+            }
+        }
+
+        for (std::size_t digit = 0; digit < radixBuckets; digit++)
+        {
+            auto line = lines.begin() + digit * lineLength;
+            std::copy(line, line + filled[digit], destination + offsets[digit]);
+        }
+    }
+    else if (construct)
+    {
+        for (; first != last; ++first)
+        {
+            ::new (static_cast<void*>(std::addressof(destination[offsets[getDigit(*first)]++]))) Value(std::move(*first));
+        }
+    }
+    else
+    {
+        for (; first != last; ++first)
+        {
+            destination[offsets[getDigit(*first)]++] = std::move(*first);
+        }
+    }
+}
+
+// One stable counting pass over the digit at shift: per part histograms, offsets ordered by
+// digit and then by part, and a scatter of every part. Returns false without moving anything
+// if all elements share the digit
+template<typename SourceIt, typename DestIt, typename ThreadPool, typename KeyExtractor>
+bool RadixPass(ThreadPool& pool, std::size_t parts, SourceIt source, DestIt destination, std::size_t length,
+    std::size_t shift, KeyExtractor& keyExtractor, bool construct)
+{
+    auto getDigit = [&keyExtractor, shift](const auto& value)
+    {
+        return static_cast<std::size_t>((ToRadixKey(keyExtractor(value)) >> shift) & (radixBuckets - 1));
+    };
+
+    std::vector<std::array<std::size_t, radixBuckets>> offsets(parts);
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        std::array<std::size_t, radixBuckets>& counts = offsets[part];
+        counts.fill(0);
+
+        for (auto it = source + length * part / parts, last = source + length * (part + 1) / parts; it != last; ++it)
+        {
+            counts[getDigit(*it)]++;
+        }
+    });
+
+    for (std::size_t digit = 0; digit < radixBuckets; digit++)
+    {
+        std::size_t total = 0;
+
+        for (std::size_t part = 0; part < parts; part++)
+        {
+            total += offsets[part][digit];
+        }
+
+        if (total == length)
+        {
+            return false;
+        }
+    }
+
+    std::size_t offset = 0;
+
+    for (std::size_t digit = 0; digit < radixBuckets; digit++)
+    {
+        for (std::size_t part = 0; part < parts; part++)
+        {
+            std::size_t count = offsets[part][digit];
+            offsets[part][digit] = offset;
+            offset += count;
+        }
+    }
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        RadixScatterPart(source + length * part / parts, source + length * (part + 1) / parts,
+            destination, offsets[part], getDigit, construct);
+    });
+
+    return true;
+}
+
+// Stable LSD radix sort by the integer or floating point key returned by keyExtractor.
+// Elements ping-pong between the range and a buffer, one pass per key byte, passes over
+// bytes that are the same for every key are skipped. The buffer is uninitialized storage,
+// so the value type only has to be move constructible and move assignable
+template<typename Iter, typename ThreadPool, typename KeyExtractor>
+void ParallelRadixSort(Iter begin, Iter end, ThreadPool& pool, KeyExtractor keyExtractor)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+    using Key = std::decay_t<std::invoke_result_t<KeyExtractor&, const Value&>>;
+    using Bits = decltype(ToRadixKey(std::declval<Key>()));
+
+    std::size_t length = std::distance(begin, end);
+    if (length <= 1)
+    {
+        return;
+    }
+
+    std::size_t parts = std::clamp<std::size_t>(length / radixMinPartLength, 1u, pool.Size() + 1);
+    RadixBuffer<Value> buffer(length);
+    bool inBuffer = false;
+
+    for (std::size_t shift = 0; shift < sizeof(Bits) * 8; shift += radixBits)
+    {
+        bool moved = inBuffer ?
+            RadixPass(pool, parts, buffer.Data(), begin, length, shift, keyExtractor, false) :
+            RadixPass(pool, parts, begin, buffer.Data(), length, shift, keyExtractor, !buffer.constructed);
+
+        buffer.constructed |= moved;
+        inBuffer ^= moved;
+    }
+
+    if (inBuffer)
+    {
+        RunPartsPool(pool, parts, [&](std::size_t part)
+        {
+            std::move(buffer.Data() + length * part / parts, buffer.Data() + length * (part + 1) / parts,
+                begin + length * part / parts);
+        });
+    }
+}
+
+template<typename Iter, typename ThreadPool>
+void ParallelRadixSort(Iter begin, Iter end, ThreadPool& pool)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
+    ParallelRadixSort(begin, end, pool, [](const Value& value)
+    {
+        return value;
+    });
+}
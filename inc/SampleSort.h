@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "ThreadPool.h"
+#include "MergeSort.h"
+
+inline constexpr std::size_t sampleSortOversampling = 32;
+// Below this many elements per thread the sort is done by MergeSort alone
+inline constexpr std::size_t sampleSortMinPartLength = std::size_t(1) << 14;
+
+// Bucket 2 * i holds elements between splitters i - 1 and i, bucket 2 * i + 1 holds elements
+// equal to splitter i. Splitters are unique, so a heavily repeated key gets a bucket of its own
+// which doesn't need sorting
+template<typename Value, typename Comp>
+std::uint32_t GetSampleSortBucket(const Value& value, const std::vector<Value>& splitters, Comp& comp)
+{
+    auto it = std::lower_bound(splitters.begin(), splitters.end(), value, comp);
+    auto index = static_cast<std::uint32_t>(std::distance(splitters.begin(), it));
+
+    if (it != splitters.end() && !comp(value, *it))
+    {
+        return 2 * index + 1;
+    }
+
+    return 2 * index;
+}
+
+// Picks at most buckets - 1 unique splitters from a sorted random sample
+template<typename Iter, typename Comp>
+auto PickSplitters(Iter begin, std::size_t length, std::size_t buckets, Comp comp)
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
+    std::minstd_rand generator(static_cast<std::minstd_rand::result_type>(length));
+    std::uniform_int_distribution<std::size_t> distribution(0, length - 1);
+
+    std::vector<Value> sample;
+    sample.reserve(buckets * sampleSortOversampling);
+
+    for (std::size_t i = 0; i < buckets * sampleSortOversampling; i++)
+    {
+        sample.push_back(begin[distribution(generator)]);
+    }
+
+    MergeSort(sample.begin(), sample.end(), comp);
+
+    std::vector<Value> splitters;
+    splitters.reserve(buckets - 1);
+
+    for (std::size_t i = 1; i < buckets; i++)
+    {
+        const Value& candidate = sample[i * sampleSortOversampling];
+
+        if (splitters.empty() || comp(splitters.back(), candidate))
+        {
+            splitters.push_back(candidate);
+        }
+    }
+
+    return splitters;
+}
+
+// Stable parallel sample sort. Splitters from an oversampled random sample divide the range
+// into a bucket per thread, elements are distributed to their buckets in one parallel pass of
+// histograms and scatters, and every bucket is then sorted independently.
+// Unlike the merge sorts there is no merge level that has to wait for both halves
+template<typename Iter, typename ThreadPool, typename Comp = std::less<>>
+void ParallelSampleSort(Iter begin, Iter end, ThreadPool& pool, Comp comp = {})
+{
+    using Value = typename std::iterator_traits<Iter>::value_type;
+
+    std::size_t length = std::distance(begin, end);
+    std::size_t parts = std::min(length / sampleSortMinPartLength, pool.Size() + 1);
+
+    if (parts <= 1)
+    {
+        MergeSort(begin, end, comp);
+        return;
+    }
+
+    std::vector<Value> splitters = PickSplitters(begin, length, parts, comp);
+    std::size_t buckets = 2 * splitters.size() + 1;
+
+    std::vector<std::uint32_t> bucketOf(length);
+    std::vector<std::vector<std::size_t>> offsets(parts, std::vector<std::size_t>(buckets));
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        std::vector<std::size_t>& counts = offsets[part];
+
+        for (std::size_t i = length * part / parts; i < length * (part + 1) / parts; i++)
+        {
+            bucketOf[i] = GetSampleSortBucket(begin[i], splitters, comp);
+            counts[bucketOf[i]]++;
+        }
+    });
+
+    // Offsets ordered by bucket and then by part keep equal elements in input order
+    std::vector<std::size_t> bucketBegins(buckets + 1);
+    std::size_t offset = 0;
+
+    for (std::size_t bucket = 0; bucket < buckets; bucket++)
+    {
+        bucketBegins[bucket] = offset;
+
+        for (std::size_t part = 0; part < parts; part++)
+        {
+            std::size_t count = offsets[part][bucket];
+            offsets[part][bucket] = offset;
+            offset += count;
+        }
+    }
+
+    bucketBegins[buckets] = length;
+
+    auto buffer = MoveToBuffer(begin, end);
+
+    RunPartsPool(pool, parts, [&](std::size_t part)
+    {
+        std::vector<std::size_t>& destinations = offsets[part];
+
+        for (std::size_t i = length * part / parts; i < length * (part + 1) / parts; i++)
+        {
+            begin[destinations[bucketOf[i]]++] = std::move(buffer[i]);
+        }
+    });
+
+    // Elements are now grouped by bucket in the range, the buffer serves the bucket sorts
+    RunPartsPool(pool, buckets, [&](std::size_t bucket)
+    {
+        std::size_t first = bucketBegins[bucket];
+        std::size_t last = bucketBegins[bucket + 1];
+
+        if (bucket % 2 == 0 && last - first > 1)
+        {
+            MergeSortInternalWithBuffer(begin + first, begin + last, comp, buffer.begin() + first, false);
+        }
+    });
+}
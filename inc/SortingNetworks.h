@@ -0,0 +1,376 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <cstddef>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define SORTING_NETWORKS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define SORTING_NETWORKS_SSE2
+#endif
+
+// Bitonic sorting networks for up to maxLength ints or floats held in vector registers.
+// Every register is sorted on its own first, then sorted blocks of registers are merged
+// pairwise: the first comparator stage flips the second block, so the merge only ever puts
+// minimums in front, and the rest are half cleaners between and inside registers.
+// Networks aren't stable, which is only visible for floats that compare equal but differ,
+// like -0.0 and 0.0
+namespace SortingNetworks
+{
+    inline constexpr std::size_t maxLength = 64;
+
+    // Register operations per element type: Load, Store, Min, Max, Reverse, SortRegister, which
+    // sorts the lanes of a register, and CleanRegister, which sorts the lanes of a bitonic register.
+    // Min and Max return left on ties, so Min(a, b) and Max(b, a) are always a permutation of
+    // the pair. Float min and max instructions aren't used, they would turn -0.0 and 0.0 into
+    // two copies of the same zero
+    template<typename T>
+    struct Registers;
+
+#if defined(SORTING_NETWORKS_AVX2)
+    template<>
+    struct Registers<int>
+    {
+        using Vector = __m256i;
+
+        static constexpr std::size_t lanes = 8;
+        static constexpr int padding = std::numeric_limits<int>::max();
+
+        static Vector Load(const int* data)
+        {
+            return _mm256_loadu_si256(reinterpret_cast<const Vector*>(data));
+        }
+
+        static void Store(int* data, Vector vector)
+        {
+            _mm256_storeu_si256(reinterpret_cast<Vector*>(data), vector);
+        }
+
+        static Vector Min(Vector left, Vector right)
+        {
+            return _mm256_min_epi32(left, right);
+        }
+
+        static Vector Max(Vector left, Vector right)
+        {
+            return _mm256_max_epi32(left, right);
+        }
+
+        static Vector Reverse(Vector vector)
+        {
+            return _mm256_permutevar8x32_epi32(vector, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        }
+
+        static Vector SortRegister(Vector vector)
+        {
+            vector = Exchange<0xAA>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            vector = Exchange<0xCC>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(0, 1, 2, 3)));
+            vector = Exchange<0xAA>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            vector = Exchange<0xF0>(vector, Reverse(vector));
+            vector = Exchange<0xCC>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(1, 0, 3, 2)));
+            return Exchange<0xAA>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+        }
+
+        static Vector CleanRegister(Vector vector)
+        {
+            vector = Exchange<0xF0>(vector, _mm256_permute2x128_si256(vector, vector, 1));
+            vector = Exchange<0xCC>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(1, 0, 3, 2)));
+            return Exchange<0xAA>(vector, _mm256_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+        }
+
+    private:
+        // Lanes set in the mask keep the maximum of the lane and its partner
+        template<int mask>
+        static Vector Exchange(Vector vector, Vector partner)
+        {
+            return _mm256_blend_epi32(Min(vector, partner), Max(vector, partner), mask);
+        }
+    };
+
+    template<>
+    struct Registers<float>
+    {
+        using Vector = __m256;
+
+        static constexpr std::size_t lanes = 8;
+        static constexpr float padding = std::numeric_limits<float>::infinity();
+
+        static Vector Load(const float* data)
+        {
+            return _mm256_loadu_ps(data);
+        }
+
+        static void Store(float* data, Vector vector)
+        {
+            _mm256_storeu_ps(data, vector);
+        }
+
+        static Vector Min(Vector left, Vector right)
+        {
+            return _mm256_blendv_ps(left, right, _mm256_cmp_ps(right, left, _CMP_LT_OQ));
+        }
+
+        static Vector Max(Vector left, Vector right)
+        {
+            return _mm256_blendv_ps(left, right, _mm256_cmp_ps(left, right, _CMP_LT_OQ));
+        }
+
+        static Vector Reverse(Vector vector)
+        {
+            return _mm256_permutevar8x32_ps(vector, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        }
+
+        static Vector SortRegister(Vector vector)
+        {
+            vector = Exchange<0xAA>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            vector = Exchange<0xCC>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(0, 1, 2, 3)));
+            vector = Exchange<0xAA>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            vector = Exchange<0xF0>(vector, Reverse(vector));
+            vector = Exchange<0xCC>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(1, 0, 3, 2)));
+            return Exchange<0xAA>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+        }
+
+        static Vector CleanRegister(Vector vector)
+        {
+            vector = Exchange<0xF0>(vector, _mm256_permute2f128_ps(vector, vector, 1));
+            vector = Exchange<0xCC>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(1, 0, 3, 2)));
+            return Exchange<0xAA>(vector, _mm256_permute_ps(vector, _MM_SHUFFLE(2, 3, 0, 1)));
+        }
+
+    private:
+        template<int mask>
+        static Vector Exchange(Vector vector, Vector partner)
+        {
+            return _mm256_blend_ps(Min(vector, partner), Max(vector, partner), mask);
+        }
+    };
+#elif defined(SORTING_NETWORKS_SSE2)
+    template<>
+    struct Registers<int>
+    {
+        using Vector = __m128i;
+
+        static constexpr std::size_t lanes = 4;
+        static constexpr int padding = std::numeric_limits<int>::max();
+
+        static Vector Load(const int* data)
+        {
+            return _mm_loadu_si128(reinterpret_cast<const Vector*>(data));
+        }
+
+        static void Store(int* data, Vector vector)
+        {
+            _mm_storeu_si128(reinterpret_cast<Vector*>(data), vector);
+        }
+
+        // SSE2 has no 32 bit min and max, they are selected by a comparison
+        static Vector Min(Vector left, Vector right)
+        {
+            return Select(_mm_cmpgt_epi32(left, right), left, right);
+        }
+
+        static Vector Max(Vector left, Vector right)
+        {
+            return Select(_mm_cmpgt_epi32(right, left), left, right);
+        }
+
+        static Vector Reverse(Vector vector)
+        {
+            return _mm_shuffle_epi32(vector, _MM_SHUFFLE(0, 1, 2, 3));
+        }
+
+        static Vector SortRegister(Vector vector)
+        {
+            vector = Exchange(vector, _mm_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_epi32(0, -1, 0, -1));
+
+            vector = Exchange(vector, Reverse(vector), _mm_setr_epi32(0, 0, -1, -1));
+            return Exchange(vector, _mm_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_epi32(0, -1, 0, -1));
+        }
+
+        static Vector CleanRegister(Vector vector)
+        {
+            vector = Exchange(vector, _mm_shuffle_epi32(vector, _MM_SHUFFLE(1, 0, 3, 2)), _mm_setr_epi32(0, 0, -1, -1));
+            return Exchange(vector, _mm_shuffle_epi32(vector, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_epi32(0, -1, 0, -1));
+        }
+
+    private:
+        // Takes the lanes of right where the mask is set, the lanes of left elsewhere
+        static Vector Select(Vector mask, Vector left, Vector right)
+        {
+            return _mm_or_si128(_mm_and_si128(mask, right), _mm_andnot_si128(mask, left));
+        }
+
+        static Vector Exchange(Vector vector, Vector partner, Vector maxMask)
+        {
+            return Select(maxMask, Min(vector, partner), Max(vector, partner));
+        }
+    };
+
+    template<>
+    struct Registers<float>
+    {
+        using Vector = __m128;
+
+        static constexpr std::size_t lanes = 4;
+        static constexpr float padding = std::numeric_limits<float>::infinity();
+
+        static Vector Load(const float* data)
+        {
+            return _mm_loadu_ps(data);
+        }
+
+        static void Store(float* data, Vector vector)
+        {
+            _mm_storeu_ps(data, vector);
+        }
+
+        static Vector Min(Vector left, Vector right)
+        {
+            return Select(_mm_cmplt_ps(right, left), left, right);
+        }
+
+        static Vector Max(Vector left, Vector right)
+        {
+            return Select(_mm_cmplt_ps(left, right), left, right);
+        }
+
+        static Vector Reverse(Vector vector)
+        {
+            return _mm_shuffle_ps(vector, vector, _MM_SHUFFLE(0, 1, 2, 3));
+        }
+
+        static Vector SortRegister(Vector vector)
+        {
+            vector = Exchange(vector, _mm_shuffle_ps(vector, vector, _MM_SHUFFLE(2, 3, 0, 1)), OddLanes());
+
+            vector = Exchange(vector, Reverse(vector), UpperLanes());
+            return Exchange(vector, _mm_shuffle_ps(vector, vector, _MM_SHUFFLE(2, 3, 0, 1)), OddLanes());
+        }
+
+        static Vector CleanRegister(Vector vector)
+        {
+            vector = Exchange(vector, _mm_shuffle_ps(vector, vector, _MM_SHUFFLE(1, 0, 3, 2)), UpperLanes());
+            return Exchange(vector, _mm_shuffle_ps(vector, vector, _MM_SHUFFLE(2, 3, 0, 1)), OddLanes());
+        }
+
+    private:
+        static Vector OddLanes()
+        {
+            return _mm_castsi128_ps(_mm_setr_epi32(0, -1, 0, -1));
+        }
+
+        static Vector UpperLanes()
+        {
+            return _mm_castsi128_ps(_mm_setr_epi32(0, 0, -1, -1));
+        }
+
+        static Vector Select(Vector mask, Vector left, Vector right)
+        {
+            return _mm_or_ps(_mm_and_ps(mask, right), _mm_andnot_ps(mask, left));
+        }
+
+        static Vector Exchange(Vector vector, Vector partner, Vector maxMask)
+        {
+            return Select(maxMask, Min(vector, partner), Max(vector, partner));
+        }
+    };
+#endif
+
+    template<typename T, typename = void>
+    struct HasRegisters : std::false_type {};
+
+    template<typename T>
+    struct HasRegisters<T, std::void_t<decltype(Registers<T>::lanes)>> : std::true_type {};
+
+    // Networks only order by operator<, other comparators fall back to the generic base case
+    template<typename T, typename Comp>
+    inline constexpr bool isSupported = HasRegisters<T>::value &&
+        (std::is_same_v<Comp, std::less<>> || std::is_same_v<Comp, std::less<T>>);
+
+    // Merges the sorted blocks vectors[0, width) and vectors[width, 2 * width)
+    template<typename Traits, typename Vector>
+    void MergeBlocks(Vector* vectors, std::size_t width)
+    {
+        for (std::size_t i = 0; i < width; i++)
+        {
+            Vector& low = vectors[i];
+            Vector& high = vectors[2 * width - 1 - i];
+            Vector reversed = Traits::Reverse(high);
+
+            high = Traits::Reverse(Traits::Max(reversed, low));
+            low = Traits::Min(low, reversed);
+        }
+
+        for (std::size_t distance = width / 2; distance > 0; distance /= 2)
+        {
+            for (std::size_t first = 0; first < 2 * width; first += 2 * distance)
+            {
+                for (std::size_t i = first; i < first + distance; i++)
+                {
+                    Vector low = vectors[i];
+
+                    vectors[i] = Traits::Min(low, vectors[i + distance]);
+                    vectors[i + distance] = Traits::Max(vectors[i + distance], low);
+                }
+            }
+        }
+
+        for (std::size_t i = 0; i < 2 * width; i++)
+        {
+            vectors[i] = Traits::CleanRegister(vectors[i]);
+        }
+    }
+
+    // Sorts at most maxLength elements, the rest of the last register is padded with maximums
+    template<typename T>
+    void Sort(T* data, std::size_t length)
+    {
+        using Traits = Registers<T>;
+        using Vector = typename Traits::Vector;
+
+        constexpr std::size_t lanes = Traits::lanes;
+        constexpr std::size_t maxRegisters = maxLength / lanes;
+
+        std::size_t registers = 1;
+
+        while (registers * lanes < length)
+        {
+            registers *= 2;
+        }
+
+        T padded[maxLength];
+        std::copy(data, data + length, padded);
+        std::fill(padded + length, padded + registers * lanes, Traits::padding);
+
+        Vector vectors[maxRegisters];
+
+        for (std::size_t i = 0; i < registers; i++)
+        {
+            vectors[i] = Traits::SortRegister(Traits::Load(padded + i * lanes));
+        }
+
+        for (std::size_t width = 1; width < registers; width *= 2)
+        {
+            for (std::size_t first = 0; first < registers; first += 2 * width)
+            {
+                MergeBlocks<Traits>(vectors + first, width);
+            }
+        }
+
+        for (std::size_t i = 0; i < registers; i++)
+        {
+            Traits::Store(padded + i * lanes, vectors[i]);
+        }
+
+        std::copy(padded, padded + length, data);
+    }
+}
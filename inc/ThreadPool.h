@@ -8,6 +8,8 @@
 #include <type_traits>
 #include <memory>
 
+#include "TraceSpans.h"
+
 template<typename T>
 struct TaskQueue
 {
@@ -73,12 +75,18 @@ public:
 
     explicit ThreadPool(std::size_t size);
     bool TryExecuteTask();
+    std::size_t Size() const;
     template<typename Func>
     std::future<std::invoke_result_t<Func>> Enqueue(Func task);
+    // Executes other tasks while waiting, so a task can wait for tasks it enqueued
+    template<typename T>
+    void WaitFor(const std::future<T>& future);
 
     bool PopFromThreadQueue(StoredFunc& func);
     bool PopFromGlobalQueue(StoredFunc& func);
     bool PopFromOtherThreadQueue(StoredFunc& func);
+    // Own queue first, then the global one, then stealing from other workers
+    bool PopTask(StoredFunc& func);
     
     ~ThreadPool();
     ThreadPool(const ThreadPool&) = delete;
@@ -99,6 +107,8 @@ std::future<std::invoke_result_t<Func>> ThreadPool::Enqueue(Func task)
 {
     using ReturnType = std::invoke_result_t<Func>;
 
+    TRACE_INSTANT("ThreadPool::Enqueue");
+
     // Easiest way to make packaged task copyable
     auto packagedTask = std::make_shared<std::packaged_task<ReturnType()>>(std::move(task));
     std::future<ReturnType> future = packagedTask->get_future();
@@ -118,4 +128,16 @@ std::future<std::invoke_result_t<Func>> ThreadPool::Enqueue(Func task)
     }
 
     return future;
+}
+
+template<typename T>
+void ThreadPool::WaitFor(const std::future<T>& future)
+{
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+        if (!TryExecuteTask())
+        {
+            std::this_thread::yield();
+        }
+    }
 }
\ No newline at end of file
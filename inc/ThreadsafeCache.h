@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
+
+#include "ThreadsafeHashMap.h"
+
+struct CacheStatistics
+{
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t evictions = 0;
+    std::size_t expirations = 0;
+};
+
+// Bounded cache sharded the same way as HashMap: every shard is a LockedTable with the Table
+// layout and Mutex of HashMap plus a CLOCK ring, with the capacity split evenly between shards.
+// A hit only takes the shared lock and sets the reference bit of its ring slot, the hand clears
+// reference bits and evicts the first unreferenced (or expired) element when a full shard inserts.
+// A zero ttl means elements never expire
+template<typename Key, typename Value, std::size_t size = 17u, typename Hash = std::hash<Key>,
+    typename Allocator = std::allocator<std::pair<Key, Value>>,
+    template<typename, typename, typename> typename Table = ChainedHashTable, typename Mutex = std::shared_mutex>
+class Cache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Cache(std::size_t capacity, Clock::duration ttl = Clock::duration::zero(), Hash hash = Hash()) :
+        hash(std::move(hash))
+    {
+        std::size_t shardCapacity = std::max<std::size_t>((capacity + size - 1) / size, 1u);
+
+        for (auto& shard : shards)
+        {
+            shard.Initialize(shardCapacity, ttl);
+        }
+    }
+
+    std::optional<Value> Get(const Key& key)
+    {
+        std::size_t hashValue = hash(key);
+        return shards[Selector::GetIndex(hashValue)].Get(key, Selector::GetBucketHash(hashValue));
+    }
+
+    void Put(const Key& key, const Value& value)
+    {
+        std::size_t hashValue = hash(key);
+        shards[Selector::GetIndex(hashValue)].Put(key, Selector::GetBucketHash(hashValue), value);
+    }
+
+    // The factory runs under the shard lock, so concurrent misses of a key call it once
+    template<typename Factory>
+    Value GetOrCompute(const Key& key, Factory factory)
+    {
+        std::size_t hashValue = hash(key);
+        return shards[Selector::GetIndex(hashValue)].GetOrCompute(key, Selector::GetBucketHash(hashValue), factory);
+    }
+
+    bool Erase(const Key& key)
+    {
+        std::size_t hashValue = hash(key);
+        return shards[Selector::GetIndex(hashValue)].Erase(key, Selector::GetBucketHash(hashValue));
+    }
+
+    // Expired elements are counted until they are evicted or overwritten
+    std::size_t Size() const
+    {
+        std::size_t result = 0;
+
+        for (const auto& shard : shards)
+        {
+            result += shard.Size();
+        }
+
+        return result;
+    }
+
+    CacheStatistics GetStatistics() const
+    {
+        CacheStatistics result;
+
+        for (const auto& shard : shards)
+        {
+            shard.AddStatistics(result);
+        }
+
+        return result;
+    }
+
+    Cache(const Cache&) = delete;
+    Cache(Cache&&) = delete;
+    Cache& operator=(const Cache&) = delete;
+    Cache& operator=(Cache&&) = delete;
+
+private:
+    struct Entry
+    {
+        Value value;
+        std::size_t slot;
+    };
+
+    // Ring slots keep a copy of the key, so the hand can erase evicted elements from the table,
+    // and the expiry, so sweeping the ring doesn't need table lookups
+    struct Slot
+    {
+        std::optional<Key> key;
+        std::size_t hash = 0;
+        Clock::time_point expiry;
+        std::atomic<bool> referenced = false;
+    };
+
+    using EntryAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<Key, Entry>>;
+
+    class Shard : private LockedTable<Key, Entry, EntryAllocator, Table, Mutex>
+    {
+    public:
+        void Initialize(std::size_t shardCapacity, Clock::duration shardTtl)
+        {
+            capacity = shardCapacity;
+            ttl = shardTtl;
+            ring = std::make_unique<Slot[]>(capacity);
+        }
+
+        std::optional<Value> Get(const Key& key, std::size_t hash)
+        {
+            std::shared_lock sharedLock(mutex);
+
+            const Entry* entry = table.Find(key, hash);
+
+            if (!entry || IsExpired(ring[entry->slot]))
+            {
+                Count(misses);
+                return std::nullopt;
+            }
+
+            Touch(*entry);
+            Count(hits);
+
+            return entry->value;
+        }
+
+        void Put(const Key& key, std::size_t hash, const Value& value)
+        {
+            std::scoped_lock uniqueLock(mutex);
+
+            if (Entry* entry = table.Find(key, hash))
+            {
+                entry->value = value;
+                ring[entry->slot].expiry = GetExpiry();
+                Touch(*entry);
+                return;
+            }
+
+            Insert(key, hash, value);
+        }
+
+        template<typename Factory>
+        Value GetOrCompute(const Key& key, std::size_t hash, Factory& factory)
+        {
+            if (std::optional<Value> value = Get(key, hash))
+            {
+                return std::move(*value);
+            }
+
+            std::scoped_lock uniqueLock(mutex);
+
+            if (Entry* entry = table.Find(key, hash))
+            {
+                if (!IsExpired(ring[entry->slot]))
+                {
+                    Touch(*entry);
+                    return entry->value;
+                }
+
+                entry->value = factory();
+                ring[entry->slot].expiry = GetExpiry();
+                return entry->value;
+            }
+
+            return Insert(key, hash, factory()).value;
+        }
+
+        bool Erase(const Key& key, std::size_t hash)
+        {
+            std::scoped_lock uniqueLock(mutex);
+
+            const Entry* entry = table.Find(key, hash);
+
+            if (!entry)
+            {
+                return false;
+            }
+
+            ring[entry->slot].key.reset();
+            table.Erase(key, hash);
+
+            return true;
+        }
+
+        std::size_t Size() const
+        {
+            std::shared_lock sharedLock(mutex);
+
+            return table.Size();
+        }
+
+        void AddStatistics(CacheStatistics& statistics) const
+        {
+            statistics.hits += hits.load(std::memory_order_relaxed);
+            statistics.misses += misses.load(std::memory_order_relaxed);
+            statistics.evictions += evictions.load(std::memory_order_relaxed);
+            statistics.expirations += expirations.load(std::memory_order_relaxed);
+        }
+
+    private:
+        static void Count(std::atomic<std::size_t>& counter)
+        {
+            counter.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        bool IsExpired(const Slot& slot) const
+        {
+            return ttl != Clock::duration::zero() && Clock::now() >= slot.expiry;
+        }
+
+        Clock::time_point GetExpiry() const
+        {
+            return ttl != Clock::duration::zero() ? Clock::now() + ttl : Clock::time_point::max();
+        }
+
+        // Readers only write the bit if it isn't set yet, so hot elements don't bounce the cache line
+        void Touch(const Entry& entry)
+        {
+            std::atomic<bool>& referenced = ring[entry.slot].referenced;
+
+            if (!referenced.load(std::memory_order_relaxed))
+            {
+                referenced.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        Entry& Insert(const Key& key, std::size_t hash, const Value& value)
+        {
+            std::size_t slot = FindFreeSlot();
+
+            ring[slot].key.emplace(key);
+            ring[slot].hash = hash;
+            ring[slot].expiry = GetExpiry();
+            ring[slot].referenced.store(false, std::memory_order_relaxed);
+
+            Entry* entry = table.TryEmplace(key, hash, Entry{ value, slot }).first;
+
+            return *entry;
+        }
+
+        // Empty slots are taken right away, otherwise the hand gives every referenced element
+        // a second chance and evicts the first one that wasn't used since the last sweep
+        std::size_t FindFreeSlot()
+        {
+            while (true)
+            {
+                std::size_t slot = hand;
+                hand = (hand + 1) % capacity;
+
+                Slot& candidate = ring[slot];
+
+                if (!candidate.key)
+                {
+                    return slot;
+                }
+
+                bool expired = IsExpired(candidate);
+
+                if (!expired && candidate.referenced.load(std::memory_order_relaxed))
+                {
+                    candidate.referenced.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+
+                Count(expired ? expirations : evictions);
+                table.Erase(*candidate.key, candidate.hash);
+                candidate.key.reset();
+
+                return slot;
+            }
+        }
+
+        using LockedTableType = LockedTable<Key, Entry, EntryAllocator, Table, Mutex>;
+        using LockedTableType::mutex;
+        using LockedTableType::table;
+
+        std::unique_ptr<Slot[]> ring;
+        std::size_t capacity = 0;
+        std::size_t hand = 0;
+        Clock::duration ttl{};
+
+        std::atomic<std::size_t> hits = 0;
+        std::atomic<std::size_t> misses = 0;
+        std::atomic<std::size_t> evictions = 0;
+        std::atomic<std::size_t> expirations = 0;
+    };
+
+    using Selector = BucketSelector<size>;
+
+    Hash hash;
+    std::array<Shard, size> shards;
+};
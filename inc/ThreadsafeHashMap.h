@@ -1,120 +1,578 @@
 #pragma once
 
 #include <unordered_map>
-#include <list>
 #include <array>
 #include <mutex>
 #include <shared_mutex>
 #include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <future>
+#include <string_view>
+#include <type_traits>
 
-template<typename Key, typename Value>
-struct Bucket
+#include "ThreadPool.h"
+#include "ChainedHashTable.h"
+#include "FlatHashTable.h"
+#include "OptimisticRead.h"
+#include "BigReaderMutex.h"
+
+// Position of a key in a batch and its bucket hash
+struct BatchEntry
+{
+    std::size_t position;
+    std::size_t hash;
+};
+
+// Transparent hash of std::string keys, lets HashMap look up std::string_view
+// and C strings without constructing a temporary std::string
+struct StringHash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view key) const
+    {
+        return std::hash<std::string_view>()(key);
+    }
+};
+
+template<typename Hash, typename = void>
+struct IsTransparent : std::false_type {};
+
+template<typename Hash>
+struct IsTransparent<Hash, std::void_t<typename Hash::is_transparent>> : std::true_type {};
+
+// Converts to the result of the factory, passed to TryEmplace so the value
+// is only computed if it's actually inserted
+template<typename Factory>
+struct LazyValue
+{
+    operator std::invoke_result_t<Factory&>() const
+    {
+        return factory();
+    }
+
+    Factory& factory;
+};
+
+// Picks the bucket of a hash. Bits used for the bucket index are dropped from the hash the
+// bucket's table receives, so entries of a bucket are spread over its slots
+template<std::size_t size>
+struct BucketSelector
+{
+    static std::size_t GetIndex(std::size_t hashValue)
+    {
+        return hashValue % size;
+    }
+
+    static std::size_t GetBucketHash(std::size_t hashValue)
+    {
+        return hashValue / size;
+    }
+};
+
+// Hash table layout of a bucket and the lock guarding it, shared by HashMap buckets and Cache shards
+template<typename Key, typename Value, typename Allocator, template<typename, typename, typename> typename Table, typename Mutex>
+struct LockedTable
+{
+    using TableType = Table<Key, Value, Allocator>;
+
+    mutable Mutex mutex;
+    TableType table;
+};
+
+// Separately locked part of HashMap, Table is an unsynchronized hash table layout
+// (ChainedHashTable or FlatHashTable) receiving the hash bits not used to pick the bucket.
+// Writers hold the mutex exclusively and bump the seqlock version, so for trivially copyable
+// keys and values Get first tries to read without writing any shared memory.
+// Mutex is std::shared_mutex or BigReaderMutex for read-mostly maps with locked reads
+template<typename Key, typename Value, typename Allocator = std::allocator<std::pair<Key, Value>>,
+    template<typename, typename, typename> typename Table = ChainedHashTable, typename Mutex = std::shared_mutex>
+struct Bucket : private LockedTable<Key, Value, Allocator, Table, Mutex>
 {
 public:
     using element = std::pair<Key, Value>;
-    using iterator = typename std::list<element>::iterator;
-    using const_iterator = typename std::list<element>::const_iterator;
+    using TableType = Table<Key, Value, Allocator>;
 
-    Value Get(const Key& key, const Value& defaultValue) const
+    static constexpr std::size_t optimisticAttempts = 4u;
+    static constexpr std::size_t prefetchDistance = 8u;
+
+    template<typename K>
+    Value Get(const K& key, std::size_t hash, const Value& defaultValue) const
     {
+        if constexpr (TableType::optimisticReads)
+        {
+            for (std::size_t attempt = 0; attempt < optimisticAttempts; attempt++)
+            {
+                std::uint64_t version = seqLock.ReadBegin();
+                Value value = defaultValue;
+                OptimisticReadResult result = table.FindOptimistic(key, hash, value);
+
+                if (result != OptimisticReadResult::Retry && seqLock.ReadValidate(version))
+                {
+                    return result == OptimisticReadResult::Found ? value : defaultValue;
+                }
+            }
+        }
+
         std::shared_lock sharedLock(mutex);
 
-        auto it = FindElement(key);
+        const Value* value = table.Find(key, hash);
 
-        return it != data.end() ? it->second : defaultValue;
+        return value ? *value : defaultValue;
     }
 
-    void AddOrUpdate(const Key& key, const Value& value)
+    template<typename K, typename Func>
+    bool Visit(const K& key, std::size_t hash, Func& func) const
     {
+        std::shared_lock sharedLock(mutex);
+
+        const Value* value = table.Find(key, hash);
+
+        if (!value)
+        {
+            return false;
+        }
+
+        func(*value);
+        return true;
+    }
+
+    // Present values are read under the shared lock first, so only misses serialize
+    template<typename K, typename Factory>
+    Value GetOrCompute(const K& key, std::size_t hash, Factory& factory)
+    {
+        {
+            std::shared_lock sharedLock(mutex);
+
+            if (const Value* value = table.Find(key, hash))
+            {
+                return *value;
+            }
+        }
+
         std::scoped_lock uniqueLock(mutex);
+        SeqLock::WriteScope writeScope(seqLock);
 
-        auto it = FindElement(key);
+        return *table.TryEmplace(key, hash, LazyValue<Factory>{ factory }).first;
+    }
+
+    template<typename K, typename Func, typename... Args>
+    bool Upsert(const K& key, std::size_t hash, Func& func, Args&&... args)
+    {
+        std::scoped_lock uniqueLock(mutex);
+        SeqLock::WriteScope writeScope(seqLock);
+
+        auto [value, inserted] = table.TryEmplace(key, hash, std::forward<Args>(args)...);
 
-        if (it == data.end())
+        if (!inserted)
         {
-            data.emplace_back(key, value);
+            Modify(*value, func);
         }
-        else
+
+        return inserted;
+    }
+
+    // Optimistic readers are only disturbed if the key is present
+    template<typename K, typename Func>
+    bool ComputeIfPresent(const K& key, std::size_t hash, Func& func)
+    {
+        std::scoped_lock uniqueLock(mutex);
+
+        Value* value = table.Find(key, hash);
+
+        if (!value)
         {
-            it->second = value;
+            return false;
         }
+
+        SeqLock::WriteScope writeScope(seqLock);
+        Modify(*value, func);
+
+        return true;
     }
 
-    void Erase(const Key& key)
+    // Looks up keys[entry.position] for every entry of the range under a single lock,
+    // results are stored to the same positions of values
+    void MultiGet(const BatchEntry* first, const BatchEntry* last, const std::vector<Key>& keys,
+        std::vector<Value>& values, const Value& defaultValue) const
+    {
+        std::shared_lock sharedLock(mutex);
+
+        for (const BatchEntry* entry = first; entry != last; entry++)
+        {
+            PrefetchAhead(entry, last);
+
+            const Value* value = table.Find(keys[entry->position], entry->hash);
+            values[entry->position] = value ? *value : defaultValue;
+        }
+    }
+
+    void MultiUpsert(const BatchEntry* first, const BatchEntry* last, const std::vector<element>& elements)
+    {
+        std::scoped_lock uniqueLock(mutex);
+        SeqLock::WriteScope writeScope(seqLock);
+
+        for (const BatchEntry* entry = first; entry != last; entry++)
+        {
+            PrefetchAhead(entry, last);
+
+            const auto& [key, value] = elements[entry->position];
+            auto [storedValue, inserted] = table.TryEmplace(key, entry->hash, value);
+
+            if (!inserted)
+            {
+                Store(*storedValue, value);
+            }
+        }
+    }
+
+    void AddOrUpdate(const Key& key, std::size_t hash, const Value& value)
     {
         std::scoped_lock uniqueLock(mutex);
+        SeqLock::WriteScope writeScope(seqLock);
 
-        auto it = FindElement(key);
+        auto [storedValue, inserted] = table.TryEmplace(key, hash, value);
 
-        if (it != data.end())
+        if (!inserted)
         {
-            data.erase(it);
+            Store(*storedValue, value);
         }
     }
 
+    template<typename K>
+    void Erase(const K& key, std::size_t hash)
+    {
+        std::scoped_lock uniqueLock(mutex);
+        SeqLock::WriteScope writeScope(seqLock);
+
+        table.Erase(key, hash);
+    }
+
     bool Empty() const
     {
         std::shared_lock sharedLock(mutex);
 
-        return data.empty();
+        return table.Size() == 0;
     }
 
 private:
-    iterator FindElement(const Key& key)
+    // Optimistic readers may be copying a stored value, so it's replaced with OptimisticStore
+    void Store(Value& stored, const Value& value)
     {
-        return std::find_if(data.begin(), data.end(), [&key](const element& element)
+        if constexpr (TableType::optimisticReads)
         {
-            return element.first == key;
-        });
+            OptimisticStore(stored, value);
+        }
+        else
+        {
+            stored = value;
+        }
     }
 
-    const_iterator FindElement(const Key& key) const
+    template<typename Func>
+    void Modify(Value& stored, Func& func)
     {
-        return std::find_if(data.cbegin(), data.cend(), [&key](const element& element)
+        if constexpr (TableType::optimisticReads)
         {
-            return element.first == key;
-        });
+            Value value = stored;
+            func(value);
+            OptimisticStore(stored, value);
+        }
+        else
+        {
+            func(stored);
+        }
     }
 
-    mutable std::shared_mutex mutex;
-    std::list<element> data;
+    void PrefetchAhead(const BatchEntry* entry, const BatchEntry* last) const
+    {
+        if (static_cast<std::size_t>(last - entry) > prefetchDistance)
+        {
+            table.Prefetch(entry[prefetchDistance].hash);
+        }
+    }
+
+    using LockedTableType = LockedTable<Key, Value, Allocator, Table, Mutex>;
+    using LockedTableType::mutex;
+    using LockedTableType::table;
+
+    SeqLock seqLock;
 
-    template<typename, typename, std::size_t, typename>
+    template<typename, typename, std::size_t, typename, typename, template<typename, typename, typename> typename, typename>
     friend class HashMap;
 };
 
-template<typename Key, typename Value, std::size_t size = 17u, typename Hash = std::hash<Key>>
+enum class IterationMode
+{
+    // Buckets are locked one at a time, concurrent modifications of other buckets may be seen
+    PerBucket,
+    // Every bucket is locked for the whole iteration, writers are blocked until it ends
+    Consistent
+};
+
+template<typename Key, typename Value, std::size_t size = 17u, typename Hash = std::hash<Key>,
+    typename Allocator = std::allocator<std::pair<Key, Value>>,
+    template<typename, typename, typename> typename Table = ChainedHashTable, typename Mutex = std::shared_mutex>
 class HashMap
 {
+    // Types other than Key accepted by lookups, Key itself goes to the non-template overloads
+    template<typename K>
+    using EnableIfLookupKey = std::enable_if_t<IsTransparent<Hash>::value && !std::is_same_v<K, Key> &&
+        std::is_invocable_r_v<std::size_t, const Hash&, const K&>, int>;
+
 public:
+    using HashType = Hash;
+
     HashMap() = default;
-    HashMap(Hash hash) : 
+    HashMap(Hash hash) :
         hash(std::move(hash))
     { }
 
     Value Get(const Key& key, const Value& defaultValue = Value()) const
     {
-        return data[GetIndex(key)].Get(key, defaultValue);
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].Get(key, Selector::GetBucketHash(hashValue), defaultValue);
     }
 
     void AddOrUpdate(const Key& key, const Value& value)
     {
-        data[GetIndex(key)].AddOrUpdate(key, value);
+        std::size_t hashValue = hash(key);
+        data[Selector::GetIndex(hashValue)].AddOrUpdate(key, Selector::GetBucketHash(hashValue), value);
     }
 
     void Erase(const Key& key)
     {
-        data[GetIndex(key)].Erase(key);
+        std::size_t hashValue = hash(key);
+        data[Selector::GetIndex(hashValue)].Erase(key, Selector::GetBucketHash(hashValue));
+    }
+
+    // Calls func(const Value&) under the shared lock without copying the value,
+    // returns whether the key was present
+    template<typename Func>
+    bool Visit(const Key& key, Func func) const
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].Visit(key, Selector::GetBucketHash(hashValue), func);
+    }
+
+    // Returns the stored value, if the key is absent the result of factory() is inserted
+    // under the same exclusive lock, so concurrent callers never compute it twice for the map
+    template<typename Factory>
+    Value GetOrCompute(const Key& key, Factory factory)
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].GetOrCompute(key, Selector::GetBucketHash(hashValue), factory);
+    }
+
+    // Calls func(Value&) if the key is present, otherwise inserts Value(args...) without
+    // calling func. Returns whether the value was inserted
+    template<typename Func, typename... Args>
+    bool Upsert(const Key& key, Func func, Args&&... args)
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].Upsert(key, Selector::GetBucketHash(hashValue), func, std::forward<Args>(args)...);
+    }
+
+    // Calls func(Value&) only if the key is present, returns whether it was
+    template<typename Func>
+    bool ComputeIfPresent(const Key& key, Func func)
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].ComputeIfPresent(key, Selector::GetBucketHash(hashValue), func);
+    }
+
+    // Heterogeneous overloads, enabled for a transparent Hash such as StringHash.
+    // The key is only converted to Key if an element has to be inserted
+    template<typename K, EnableIfLookupKey<K> = 0>
+    Value Get(const K& key, const Value& defaultValue = Value()) const
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].Get(key, Selector::GetBucketHash(hashValue), defaultValue);
+    }
+
+    template<typename K, EnableIfLookupKey<K> = 0>
+    void Erase(const K& key)
+    {
+        std::size_t hashValue = hash(key);
+        data[Selector::GetIndex(hashValue)].Erase(key, Selector::GetBucketHash(hashValue));
+    }
+
+    template<typename K, typename Func, EnableIfLookupKey<K> = 0>
+    bool Visit(const K& key, Func func) const
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].Visit(key, Selector::GetBucketHash(hashValue), func);
+    }
+
+    template<typename K, typename Factory, EnableIfLookupKey<K> = 0>
+    Value GetOrCompute(const K& key, Factory factory)
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].GetOrCompute(key, Selector::GetBucketHash(hashValue), factory);
+    }
+
+    template<typename K, typename Func, typename... Args, EnableIfLookupKey<K> = 0>
+    bool Upsert(const K& key, Func func, Args&&... args)
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].Upsert(key, Selector::GetBucketHash(hashValue), func, std::forward<Args>(args)...);
+    }
+
+    template<typename K, typename Func, EnableIfLookupKey<K> = 0>
+    bool ComputeIfPresent(const K& key, Func func)
+    {
+        std::size_t hashValue = hash(key);
+        return data[Selector::GetIndex(hashValue)].ComputeIfPresent(key, Selector::GetBucketHash(hashValue), func);
+    }
+
+    // Hashes every key up front. With optimistic reads the keys are looked up in order while the
+    // slots of keys a few positions ahead are prefetched, otherwise each bucket is visited once,
+    // so a batch costs a single lock per bucket instead of one per key.
+    // Values are returned in the order of keys
+    std::vector<Value> MultiGet(const std::vector<Key>& keys, const Value& defaultValue = Value()) const
+    {
+        std::vector<Value> values;
+
+        if constexpr (BucketType::TableType::optimisticReads)
+        {
+            // Bucket index and hash of every key
+            std::vector<std::pair<std::size_t, std::size_t>> hashes(keys.size());
+
+            for (std::size_t position = 0; position < keys.size(); position++)
+            {
+                std::size_t hashValue = hash(keys[position]);
+                hashes[position] = { Selector::GetIndex(hashValue), Selector::GetBucketHash(hashValue) };
+            }
+
+            values.reserve(keys.size());
+
+            for (std::size_t position = 0; position < keys.size(); position++)
+            {
+                if (position + BucketType::prefetchDistance < keys.size())
+                {
+                    const auto& [index, bucketHash] = hashes[position + BucketType::prefetchDistance];
+                    data[index].table.Prefetch(bucketHash);
+                }
+
+                const auto& [index, bucketHash] = hashes[position];
+                values.push_back(data[index].Get(keys[position], bucketHash, defaultValue));
+            }
+        }
+        else
+        {
+            values.assign(keys.size(), defaultValue);
+            std::array<std::size_t, size + 1> offsets;
+            std::vector<BatchEntry> entries = GroupByBucket(keys, offsets, [](const Key& key) -> const Key&
+            {
+                return key;
+            });
+
+            for (std::size_t index = 0; index < size; index++)
+            {
+                if (offsets[index] != offsets[index + 1])
+                {
+                    data[index].MultiGet(entries.data() + offsets[index], entries.data() + offsets[index + 1],
+                        keys, values, defaultValue);
+                }
+            }
+        }
+
+        return values;
+    }
+
+    // Same as AddOrUpdate for every element, a bucket is locked once per batch.
+    // If a key repeats, the last of its elements wins
+    void MultiUpsert(const std::vector<std::pair<Key, Value>>& elements)
+    {
+        std::array<std::size_t, size + 1> offsets;
+        std::vector<BatchEntry> entries = GroupByBucket(elements, offsets, [](const auto& element) -> const Key&
+        {
+            return element.first;
+        });
+
+        for (std::size_t index = 0; index < size; index++)
+        {
+            if (offsets[index] != offsets[index + 1])
+            {
+                data[index].MultiUpsert(entries.data() + offsets[index], entries.data() + offsets[index + 1], elements);
+            }
+        }
     }
 
     bool Empty() const
     {
         return std::all_of(data.begin(), data.end(), [](const auto& bucket)
         {
-            bucket.Empty(); 
+            return bucket.Empty();
         });
     }
 
+    // Calls visitor(key, value) for every element without copying them, the visitor
+    // must not access the map
+    template<typename Visitor>
+    void ForEach(Visitor visitor, IterationMode mode = IterationMode::PerBucket) const
+    {
+        if (mode == IterationMode::Consistent)
+        {
+            auto locks = LockAllBuckets();
+
+            for (const auto& bucket : data)
+            {
+                VisitBucket(bucket, visitor);
+            }
+
+            return;
+        }
+
+        for (const auto& bucket : data)
+        {
+            std::shared_lock sharedLock(bucket.mutex);
+            VisitBucket(bucket, visitor);
+        }
+    }
+
+    // Visits buckets as separate pool tasks, so the visitor is called concurrently
+    template<typename Visitor>
+    void ParallelForEach(ThreadPool& pool, Visitor visitor, IterationMode mode = IterationMode::PerBucket) const
+    {
+        std::vector<std::shared_lock<Mutex>> locks;
+
+        if (mode == IterationMode::Consistent)
+        {
+            locks = LockAllBuckets();
+        }
+
+        std::vector<std::future<void>> futures;
+        futures.reserve(size);
+
+        for (const auto& bucket : data)
+        {
+            futures.push_back(pool.Enqueue([&bucket, &visitor, mode]()
+            {
+                if (mode == IterationMode::Consistent)
+                {
+                    VisitBucket(bucket, visitor);
+                    return;
+                }
+
+                std::shared_lock sharedLock(bucket.mutex);
+                VisitBucket(bucket, visitor);
+            }));
+        }
+
+        for (auto& future : futures)
+        {
+            pool.WaitFor(future);
+        }
+
+        for (auto& future : futures)
+        {
+            future.get();
+        }
+    }
+
     std::unordered_map<Key, Value> GetCurrentState()
     {
         std::unordered_map<Key, Value> result;
@@ -123,18 +581,78 @@ public:
         {
             std::shared_lock sharedLock(bucket.mutex);
 
-            result.insert(bucket.data.begin(), bucket.data.end());
+            bucket.table.ForEach([&result](const auto& element)
+            {
+                result.insert(element);
+            });
         }
 
         return result;
     }
 
 private:
-    std::size_t GetIndex(const Key& key) const
+    using BucketType = Bucket<Key, Value, Allocator, Table, Mutex>;
+    using Selector = BucketSelector<size>;
+
+    // Counting sort of the batch by bucket index, entries of bucket i end up in
+    // [offsets[i], offsets[i + 1]) keeping their original order
+    template<typename Batch, typename GetKey>
+    std::vector<BatchEntry> GroupByBucket(const Batch& batch, std::array<std::size_t, size + 1>& offsets, GetKey getKey) const
     {
-        return hash(key) % size;
+        std::vector<std::size_t> hashes(batch.size());
+        offsets.fill(0);
+
+        for (std::size_t position = 0; position < batch.size(); position++)
+        {
+            hashes[position] = hash(getKey(batch[position]));
+            offsets[Selector::GetIndex(hashes[position]) + 1]++;
+        }
+
+        for (std::size_t index = 0; index < size; index++)
+        {
+            offsets[index + 1] += offsets[index];
+        }
+
+        std::vector<BatchEntry> entries(batch.size());
+        std::array<std::size_t, size> next;
+        std::copy(offsets.begin(), offsets.end() - 1, next.begin());
+
+        for (std::size_t position = 0; position < batch.size(); position++)
+        {
+            entries[next[Selector::GetIndex(hashes[position])]++] = { position, Selector::GetBucketHash(hashes[position]) };
+        }
+
+        return entries;
+    }
+
+    // Writers only ever hold a single bucket lock, so locking in index order can't deadlock
+    std::vector<std::shared_lock<Mutex>> LockAllBuckets() const
+    {
+        std::vector<std::shared_lock<Mutex>> locks;
+        locks.reserve(size);
+
+        for (const auto& bucket : data)
+        {
+            locks.emplace_back(bucket.mutex);
+        }
+
+        return locks;
+    }
+
+    template<typename Visitor>
+    static void VisitBucket(const BucketType& bucket, Visitor& visitor)
+    {
+        bucket.table.ForEach([&visitor](const auto& element)
+        {
+            visitor(element.first, element.second);
+        });
     }
 
     Hash hash;
-    std::array<Bucket<Key, Value>, size> data;
+    std::array<BucketType, size> data;
 };
+
+// HashMap with open addressing buckets, best suited for small trivially copyable keys and values
+template<typename Key, typename Value, std::size_t size = 17u, typename Hash = std::hash<Key>,
+    typename Allocator = std::allocator<std::pair<Key, Value>>, typename Mutex = std::shared_mutex>
+using FlatHashMap = HashMap<Key, Value, size, Hash, Allocator, FlatHashTable, Mutex>;
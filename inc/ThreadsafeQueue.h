@@ -3,29 +3,36 @@
 #include <memory>
 #include <mutex>
 
+#include "AllocatorHelpers.h"
+
 namespace Threadsafe
 {
-    template<typename T>
+    template<typename T, typename Allocator>
     struct Node
     {
+        using Pointer = std::unique_ptr<Node, AllocatorDeleter<Node, Allocator>>;
+
         std::unique_ptr<T> data;
-        std::unique_ptr<Node<T>> next;
+        Pointer next;
     };
 
 
-    template<typename T>
+    template<typename T, typename Allocator = std::allocator<T>>
     class Queue
     {
     public:
+        using NodeType = Node<T, Allocator>;
+        using NodePointer = typename NodeType::Pointer;
+
         Queue()
         {
-            head = std::make_unique<Node<T>>();
+            head = NodePointer(AllocateObject<NodeType, Allocator>());
             tail = head.get();
         }
 
         std::unique_ptr<T> Pop()
         {
-            std::unique_ptr<Node<T>> oldHead;
+            NodePointer oldHead;
 
             {
                 std::scoped_lock headLock(headMutex);
@@ -45,7 +52,7 @@ namespace Threadsafe
         template<typename Param>
         void Push(Param&& value)
         {
-            std::unique_ptr<Node<T>> newNode = std::make_unique<Node<T>>();
+            NodePointer newNode(AllocateObject<NodeType, Allocator>());
 
             std::scoped_lock tailLock(tailMutex);
 
@@ -61,21 +68,21 @@ namespace Threadsafe
             return IsEmptyInternal();
         }
 
-        Queue(const Queue<T>&) = delete;
-        Queue(Queue<T>&&) = delete;
-        Queue& operator=(const Queue<T>&) = delete;
-        Queue& operator=(Queue<T>&&) = delete;
+        Queue(const Queue&) = delete;
+        Queue(Queue&&) = delete;
+        Queue& operator=(const Queue&) = delete;
+        Queue& operator=(Queue&&) = delete;
 
     private:
-        std::unique_ptr<Node<T>> PopHead()
+        NodePointer PopHead()
         {
-            std::unique_ptr<Node<T>> oldHead = std::move(head);
+            NodePointer oldHead = std::move(head);
             head = std::move(oldHead->next);
             
             return oldHead;
         }
 
-        Node<T>* GetTail() const
+        NodeType* GetTail() const
         {
             std::scoped_lock tailLock(tailMutex);
 
@@ -90,7 +97,7 @@ namespace Threadsafe
         mutable std::mutex headMutex;
         mutable std::mutex tailMutex;
 
-        std::unique_ptr<Node<T>> head;
-        Node<T>* tail;
+        NodePointer head;
+        NodeType* tail;
     };
 }
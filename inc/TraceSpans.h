@@ -0,0 +1,214 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+
+#include "Tracer.h"
+
+// Span macros are compiled in only with TRACE_SPANS defined (the TEST_TRACE_SPANS CMake option),
+// otherwise they expand to nothing. Names have to be string literals without quotes or backslashes
+#ifdef TRACE_SPANS
+// Every use site registers its name once
+#define TRACE_SPAN_ID(name) ([]() { static const std::uint32_t spanId = Tracing::RegisterSpanName(name); return spanId; }())
+#define TRACE_SPAN_CONCAT_INNER(a, b) a##b
+#define TRACE_SPAN_CONCAT(a, b) TRACE_SPAN_CONCAT_INNER(a, b)
+// Records a span from here to the end of the scope
+#define TRACE_SPAN(name) Tracing::ScopedSpan TRACE_SPAN_CONCAT(traceSpan, __LINE__)(TRACE_SPAN_ID(name), 0, true)
+#define TRACE_SPAN_ARG(name, arg) \
+    Tracing::ScopedSpan TRACE_SPAN_CONCAT(traceSpan, __LINE__)(TRACE_SPAN_ID(name), static_cast<std::uint64_t>(arg), true)
+// Same, but only if condition holds, so small recursion levels don't flood the trace
+#define TRACE_SPAN_ARG_IF(condition, name, arg) \
+    Tracing::ScopedSpan TRACE_SPAN_CONCAT(traceSpan, __LINE__)(TRACE_SPAN_ID(name), static_cast<std::uint64_t>(arg), condition)
+// Spans that don't follow a scope
+#define TRACE_SPAN_BEGIN(name) Tracing::RecordSpan(TRACE_SPAN_ID(name), Tracing::SpanPhase::Begin)
+#define TRACE_SPAN_END(name) Tracing::RecordSpan(TRACE_SPAN_ID(name), Tracing::SpanPhase::End)
+#define TRACE_INSTANT(name) Tracing::RecordSpan(TRACE_SPAN_ID(name), Tracing::SpanPhase::Instant)
+#else
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_SPAN_ARG(name, arg) ((void)0)
+#define TRACE_SPAN_ARG_IF(condition, name, arg) ((void)0)
+#define TRACE_SPAN_BEGIN(name) ((void)0)
+#define TRACE_SPAN_END(name) ((void)0)
+#define TRACE_INSTANT(name) ((void)0)
+#endif
+
+namespace Tracing
+{
+    enum class SpanPhase : std::uint32_t
+    {
+        Begin,
+        End,
+        Instant
+    };
+
+    // Span records keep the phase in the low bits of the event id and the argument in args[0]
+    inline constexpr std::uint32_t spanPhaseBits = 2;
+    inline constexpr std::size_t spanRingSize = std::size_t(1) << 14;
+
+    using SpanTracer = Tracer<spanRingSize>;
+
+    inline std::mutex spanMutex;
+    inline std::vector<std::string> spanNames;
+    // Stopped tracers are kept alive, a thread that loaded the active one just before it was
+    // stopped may still write to its ring
+    inline std::vector<std::unique_ptr<SpanTracer>> spanTracers;
+    inline std::atomic<SpanTracer*> activeSpanTracer{ nullptr };
+
+    inline std::uint32_t RegisterSpanName(const char* name)
+    {
+        std::lock_guard<std::mutex> lock(spanMutex);
+        spanNames.emplace_back(name);
+
+        return static_cast<std::uint32_t>(spanNames.size() - 1);
+    }
+
+    inline void RecordSpan(std::uint32_t nameId, SpanPhase phase, std::uint64_t arg = 0) noexcept
+    {
+        SpanTracer* tracer = activeSpanTracer.load(std::memory_order_acquire);
+
+        if (tracer)
+        {
+            tracer->Trace((nameId << spanPhaseBits) | static_cast<std::uint32_t>(phase), arg);
+        }
+    }
+
+    class ScopedSpan
+    {
+    public:
+        ScopedSpan(std::uint32_t nameId, std::uint64_t arg, bool record) noexcept :
+            nameId(nameId),
+            record(record)
+        {
+            if (record)
+            {
+                RecordSpan(nameId, SpanPhase::Begin, arg);
+            }
+        }
+
+        ~ScopedSpan()
+        {
+            if (record)
+            {
+                RecordSpan(nameId, SpanPhase::End);
+            }
+        }
+
+        ScopedSpan(const ScopedSpan&) = delete;
+        ScopedSpan(ScopedSpan&&) = delete;
+
+        ScopedSpan& operator=(const ScopedSpan&) = delete;
+        ScopedSpan& operator=(ScopedSpan&&) = delete;
+
+    private:
+        std::uint32_t nameId;
+        bool record;
+    };
+
+    // Spans of all threads are recorded to the binary trace file at path until StopSpans
+    inline void StartSpans(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(spanMutex);
+
+        if (activeSpanTracer.load(std::memory_order_relaxed))
+        {
+            throw std::logic_error("Spans are already being recorded");
+        }
+
+        spanTracers.push_back(std::make_unique<SpanTracer>(path));
+        activeSpanTracer.store(spanTracers.back().get(), std::memory_order_release);
+    }
+
+    // Writes the rest of the spans and closes the trace file
+    inline void StopSpans()
+    {
+        SpanTracer* tracer = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(spanMutex);
+            tracer = activeSpanTracer.exchange(nullptr, std::memory_order_acq_rel);
+        }
+
+        if (tracer)
+        {
+            tracer->Stop();
+        }
+    }
+
+    // Converts a span trace file to the Chrome trace event format, which chrome://tracing and
+    // ui.perfetto.dev open as a timeline with a track per thread. Span names are registered at
+    // run time, so only the process that recorded the spans can convert them
+    inline void ExportChromeTrace(const std::string& tracePath, const std::string& jsonPath)
+    {
+        std::ifstream input(tracePath, std::ios::binary);
+        std::array<char, 4> magic{};
+        std::uint32_t recordSize = 0;
+
+        input.read(magic.data(), magic.size());
+        input.read(reinterpret_cast<char*>(&recordSize), sizeof(recordSize));
+
+        if (!input || magic != fileMagic || recordSize != sizeof(TraceRecord))
+        {
+            throw std::runtime_error("Not a trace file " + tracePath);
+        }
+
+        std::ofstream output(jsonPath, std::ios::trunc);
+
+        if (!output)
+        {
+            throw std::runtime_error("Can't open " + jsonPath);
+        }
+
+        std::vector<std::string> names;
+
+        {
+            std::lock_guard<std::mutex> lock(spanMutex);
+            names = spanNames;
+        }
+
+        constexpr std::array<char, 3> phases = { 'B', 'E', 'i' };
+        TraceRecord record;
+        bool first = true;
+
+        output << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+        while (input.read(reinterpret_cast<char*>(&record), sizeof(record)))
+        {
+            std::uint32_t nameId = record.eventId >> spanPhaseBits;
+            std::uint32_t phase = record.eventId & ((1u << spanPhaseBits) - 1);
+
+            if (nameId >= names.size() || phase >= phases.size())
+            {
+                continue;
+            }
+
+            // Timestamps are in microseconds
+            output << (first ? "\n" : ",\n") << "{\"name\":\"" << names[nameId] << "\",\"ph\":\"" << phases[phase] <<
+                "\",\"ts\":" << record.timestamp / 1000 << '.' << std::setw(3) << std::setfill('0') << record.timestamp % 1000 <<
+                ",\"pid\":1,\"tid\":" << record.threadIndex;
+
+            if (phase == static_cast<std::uint32_t>(SpanPhase::Instant))
+            {
+                output << ",\"s\":\"t\"";
+            }
+
+            if (phase != static_cast<std::uint32_t>(SpanPhase::End) && record.args[0] != 0)
+            {
+                output << ",\"args\":{\"value\":" << record.args[0] << "}";
+            }
+
+            output << "}";
+            first = false;
+        }
+
+        output << "\n]}\n";
+    }
+}
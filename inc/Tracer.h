@@ -1,48 +1,297 @@
 #pragma once
 
 #include <array>
+#include <vector>
 #include <string>
+#include <memory>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <chrono>
 #include <fstream>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
 
-struct DataEntry
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TRACER_HAS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACER_HAS_RDTSC
+#endif
+
+// Fixed size binary trace record. In the rings the timestamp is in clock ticks,
+// in the file it's in nanoseconds since the tracer was created
+struct TraceRecord
 {
-    std::thread::id threadId;
-    std::string message;
+    std::uint64_t timestamp;
+    std::uint32_t eventId;
+    std::uint32_t threadIndex;
+    std::array<std::uint64_t, 2> args;
 };
 
-template<std::size_t Size>
+namespace Tracing
+{
+    // The file starts with the magic and the record size, then records follow in drain order,
+    // which is ordered in time per thread only
+    inline constexpr std::array<char, 4> fileMagic = { 'T', 'R', 'C', '1' };
+
+    inline std::atomic<std::uint64_t> nextTracerId{ 1 };
+
+    inline constexpr std::chrono::milliseconds calibrationInterval(10);
+
+    // The time stamp counter is read in a few nanoseconds, steady_clock can take several times that
+    inline std::uint64_t ReadTicks() noexcept
+    {
+#ifdef TRACER_HAS_RDTSC
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+}
+
+// Low overhead tracer. Every thread writes fixed size records into a ring of its own, where it is
+// the only writer, so a trace call is a clock read, a record store and a release store of the
+// ring head. A background thread drains all rings into a binary file. When a ring is full the
+// record is dropped and counted instead of blocking the traced thread.
+// RingSize is the amount of records per thread and has to be a power of two
+template<std::size_t RingSize>
 class Tracer
 {
+    static_assert(RingSize > 0 && (RingSize & (RingSize - 1)) == 0, "Ring size has to be a power of two");
+
 public:
-    Tracer() :
-        nextElementToWrite(0)
-    { }
+    explicit Tracer(const std::string& path, std::chrono::milliseconds drainInterval = std::chrono::milliseconds(1)) :
+        id(Tracing::nextTracerId.fetch_add(1, std::memory_order_relaxed)),
+        file(path, std::ios::binary | std::ios::trunc),
+        drainInterval(drainInterval),
+        startTicks(Tracing::ReadTicks()),
+        startTime(std::chrono::steady_clock::now())
+    {
+        if (!file)
+        {
+            throw std::runtime_error("Can't open trace file " + path);
+        }
 
-    std::size_t Trace(std::string&& message)
+        std::uint32_t recordSize = sizeof(TraceRecord);
+        file.write(Tracing::fileMagic.data(), Tracing::fileMagic.size());
+        file.write(reinterpret_cast<const char*>(&recordSize), sizeof(recordSize));
+
+        drainThread = std::thread(&Tracer::DrainLoop, this);
+    }
+
+    // Every thread that traced has to be done with it
+    ~Tracer()
     {
-        return 0u;
+        Stop();
+    }
+
+    Tracer(const Tracer&) = delete;
+    Tracer(Tracer&&) = delete;
 
-        // At first I've implemented a circle buffer, but there was a problem
-        // when a thread without proper synchronization was seeing changes to an
-        // old message added by another thread, causing a potential double free during move. 
-        // I don't see a workaround without using some form of synchronization 
-        // (which can hide some data races)
-        std::size_t elementToWriteIndex = nextElementToWrite.fetch_add(1, std::memory_order_relaxed);
+    Tracer& operator=(const Tracer&) = delete;
+    Tracer& operator=(Tracer&&) = delete;
 
-        if (elementToWriteIndex >= Size)
+    void Trace(std::uint32_t eventId, std::uint64_t arg0 = 0, std::uint64_t arg1 = 0) noexcept
+    {
+        Ring& ring = GetRing();
+        std::size_t head = ring.head.load(std::memory_order_relaxed);
+
+        // The writer only looks at the reader's position when its cached copy says the ring is full
+        if (head - ring.cachedTail == RingSize)
         {
-            throw std::out_of_range("No more data enties in tracer");
+            ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+
+            if (head - ring.cachedTail == RingSize)
+            {
+                ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return;
+            }
         }
-        
-        buffer[elementToWriteIndex] = { std::this_thread::get_id(), std::move(message) };
 
-        return elementToWriteIndex;
+        ring.records[head & (RingSize - 1)] = { Tracing::ReadTicks(), eventId, ring.threadIndex, { arg0, arg1 } };
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Drains the rings a last time and closes the file. Records traced afterwards stay in the rings
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (stop)
+            {
+                return;
+            }
+
+            stop = true;
+        }
+
+        condition.notify_one();
+        drainThread.join();
+        file.close();
+    }
+
+    // Writes everything traced so far to the file
+    void Flush()
+    {
+        std::lock_guard<std::mutex> lock(drainMutex);
+        DrainRings();
+        file.flush();
+    }
+
+    // Records lost because a ring was full when they were traced
+    std::uint64_t Dropped() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::uint64_t dropped = 0;
+
+        for (const auto& ring : rings)
+        {
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+        }
+
+        return dropped;
     }
 
 private:
-    std::array<DataEntry, Size> buffer;
-    std::atomic<std::size_t> nextElementToWrite;
-};
+    struct Ring
+    {
+        std::array<TraceRecord, RingSize> records;
+        std::uint32_t threadIndex = 0;
 
+        alignas(64) std::atomic<std::size_t> head{ 0 };
+        std::size_t cachedTail = 0;
+        std::atomic<std::uint64_t> dropped{ 0 };
+
+        alignas(64) std::atomic<std::size_t> tail{ 0 };
+    };
+
+    Ring& GetRing()
+    {
+        // Most threads use one tracer, so the last lookup is checked first. Ids are never reused,
+        // so entries of destroyed tracers can't match
+        thread_local std::pair<std::uint64_t, Ring*> lastRing{ 0, nullptr };
+        thread_local std::vector<std::pair<std::uint64_t, Ring*>> threadRings;
+
+        if (lastRing.first == id)
+        {
+            return *lastRing.second;
+        }
+
+        for (const auto& entry : threadRings)
+        {
+            if (entry.first == id)
+            {
+                lastRing = entry;
+                return *entry.second;
+            }
+        }
+
+        auto ring = std::make_unique<Ring>();
+        Ring* result = ring.get();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ring->threadIndex = static_cast<std::uint32_t>(rings.size());
+            rings.push_back(std::move(ring));
+        }
+
+        lastRing = { id, result };
+        threadRings.push_back(lastRing);
+
+        return *result;
+    }
+
+    void DrainLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // The first drain measures the tick rate, a longer first wait makes it more precise
+        condition.wait_for(lock, std::max(drainInterval, Tracing::calibrationInterval), [this]() { return stop; });
+
+        lock.unlock();
+        Flush();
+        lock.lock();
+
+        while (!stop)
+        {
+            condition.wait_for(lock, drainInterval, [this]() { return stop; });
+
+            lock.unlock();
+            Flush();
+            lock.lock();
+        }
+
+        // Stop may have been called during the last drain, records traced before it still have to be written
+        lock.unlock();
+        Flush();
+    }
+
+    // Called with drainMutex locked
+    void DrainRings()
+    {
+        // Ticks are converted with one rate measured at the first drain, so timestamps of a thread
+        // stay in order across drains
+        if (nanosecondsPerTick == 0.0)
+        {
+            std::uint64_t ticks = Tracing::ReadTicks() - startTicks;
+            double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count();
+            nanosecondsPerTick = ticks > 0 ? nanoseconds / static_cast<double>(ticks) : 1.0;
+        }
+
+        std::vector<Ring*> snapshot;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (const auto& ring : rings)
+            {
+                snapshot.push_back(ring.get());
+            }
+        }
+
+        for (Ring* ring : snapshot)
+        {
+            std::size_t tail = ring->tail.load(std::memory_order_relaxed);
+            std::size_t head = ring->head.load(std::memory_order_acquire);
+
+            writeBuffer.clear();
+
+            for (; tail != head; tail++)
+            {
+                TraceRecord record = ring->records[tail & (RingSize - 1)];
+                std::uint64_t sinceStart = record.timestamp > startTicks ? record.timestamp - startTicks : 0;
+                record.timestamp = static_cast<std::uint64_t>(static_cast<double>(sinceStart) * nanosecondsPerTick);
+                writeBuffer.push_back(record);
+            }
+
+            ring->tail.store(head, std::memory_order_release);
+
+            file.write(reinterpret_cast<const char*>(writeBuffer.data()), writeBuffer.size() * sizeof(TraceRecord));
+        }
+    }
+
+    const std::uint64_t id;
+
+    mutable std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<std::unique_ptr<Ring>> rings;
+    bool stop = false;
+
+    std::mutex drainMutex;
+    std::ofstream file;
+    std::vector<TraceRecord> writeBuffer;
+    std::chrono::milliseconds drainInterval;
+
+    const std::uint64_t startTicks;
+    const std::chrono::steady_clock::time_point startTime;
+    double nanosecondsPerTick = 0.0;
+
+    std::thread drainThread;
+};
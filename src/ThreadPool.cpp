@@ -8,14 +8,39 @@ ThreadPool::ThreadPool(std::size_t size) :
     auto workerStart = [this](std::size_t index)
     {
         currentThreadQueuePtr = threadQueues[index].get();
+        bool idle = false;
 
         while (!stop.load(std::memory_order_relaxed)) 
         {
-            if (!TryExecuteTask())
+            StoredFunc task;
+
+            if (PopTask(task))
+            {
+                if (idle)
+                {
+                    TRACE_SPAN_END("ThreadPool::Idle");
+                    idle = false;
+                }
+
+                TRACE_SPAN("ThreadPool::Execute");
+                task();
+            }
+            else
             {
+                if (!idle)
+                {
+                    TRACE_SPAN_BEGIN("ThreadPool::Idle");
+                    idle = true;
+                }
+
                 std::this_thread::yield();
             }
         }
+
+        if (idle)
+        {
+            TRACE_SPAN_END("ThreadPool::Idle");
+        }
     };
 
     try
@@ -67,19 +92,49 @@ bool ThreadPool::PopFromOtherThreadQueue(StoredFunc& func)
     return false;
 }
 
-bool ThreadPool::TryExecuteTask()
+bool ThreadPool::PopTask(StoredFunc& func)
 {
-    std::function<void()> task;
+    if (PopFromThreadQueue(func))
+    {
+        TRACE_INSTANT("ThreadPool::Dequeue");
+        return true;
+    }
+
+    if (PopFromGlobalQueue(func))
+    {
+        TRACE_INSTANT("ThreadPool::DequeueGlobal");
+        return true;
+    }
 
-    if (PopFromThreadQueue(task) || PopFromGlobalQueue(task) || PopFromOtherThreadQueue(task))
+    if (PopFromOtherThreadQueue(func))
     {
-        task();
+        TRACE_INSTANT("ThreadPool::Steal");
         return true;
     }
 
     return false;
 }
 
+bool ThreadPool::TryExecuteTask()
+{
+    std::function<void()> task;
+
+    if (!PopTask(task))
+    {
+        return false;
+    }
+
+    TRACE_SPAN("ThreadPool::Execute");
+    task();
+
+    return true;
+}
+
+std::size_t ThreadPool::Size() const
+{
+    return workers.size();
+}
+
 ThreadPool::~ThreadPool() 
 {
     stop.store(true);